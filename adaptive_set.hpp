@@ -0,0 +1,371 @@
+#ifndef ADAPTIVE_SET_HPP
+#define ADAPTIVE_SET_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <random>
+#include <vector>
+#include "avl.hpp"
+#include "treap.hpp"
+#include "splay_tree.hpp"
+
+enum class Backing { avl, treap, splay };
+
+// Set facade that moves its contents to whichever tree suits the current workload.
+//
+// Every operation bumps a counter, and every 16th lookup that hits is checked
+// against a small table of recently sampled keys to estimate how skewed the
+// reads are. The keys are hashed with std::hash<T>, which should agree with
+// Compare on what is equal. At the end of each window the mix picks a tree:
+//   splits, joins and range erases above range_share -> Treap (split/join churn)
+//   reads above read_share and skew above skew_share -> SplayTree
+//   otherwise                                        -> AVL
+// A window lasts at least as many ops as there are elements, so the O(n)
+// conversion is paid for by the window, and a switch needs the same verdict
+// from two windows in a row.
+// The three trees lay their nodes out differently (a treap node carries a
+// priority, a splay node a parent pointer), so all of them allocate node_bytes,
+// enough for the largest, and a conversion rebuilds each node in place as a
+// node of the target tree. Nodes keep their addresses and nothing is allocated.
+template<typename T, typename Compare = std::less<T>>
+class AdaptiveSet {
+  public:
+	AdaptiveSet(bool _multiset = false, const Compare& _cmp = Compare());
+	unsigned size();
+	bool empty();
+	bool insert(const T& value);
+	void erase(const T& value);
+	bool contains(const T& value);
+	unsigned erase_range(const T& lo, const T& hi);
+	void split(const T& value, AdaptiveSet<T, Compare>& other, bool after=false);
+	bool join(AdaptiveSet<T, Compare>& other);
+	size_t reclaim(size_t budget = (size_t) -1);
+	Backing backing();
+	void convert(Backing target);
+
+	static const unsigned min_window = 1 << 14;
+	static constexpr double range_share = 0.01;
+	static constexpr double read_share = 0.8;
+	static constexpr double skew_share = 0.3;
+
+  private:
+	static constexpr size_t node_bytes = std::max({sizeof(typename AVL<T, Compare>::Node), sizeof(TNode<T, Compare>),
+	                                               sizeof(SNode<T, Compare>)});
+	typedef typename AVL<T, Compare, node_bytes>::Node AVLNode;
+	typedef TNode<T, Compare, false, node_bytes> TreapNode;
+	typedef SNode<T, Compare, node_bytes> SplayNode;
+
+	AVL<T, Compare, node_bytes> avl;
+	Treap<T, Compare, false, node_bytes> treap;
+	SplayTree<T, Compare, node_bytes> splay;
+	Backing current, candidate;
+	std::mt19937 rng; // priorities of the nodes a conversion to the treap makes
+
+	// Counters of the current window, ranges counts splits, joins and range erases
+	unsigned ops, reads, ranges, samples, repeats;
+	uint64_t recent[256];
+
+	void count_op();
+	void sample(const T& value);
+	void adapt();
+	template<typename Tree>
+	static bool ordered(Tree& left, Tree& right);
+
+	template<typename Node>
+	static void collect(Node* root, std::vector<Node*>& nodes);
+	template<typename Node>
+	static std::vector<Node*> detach(Node*& root);
+
+	template<typename Target, typename Node, typename... Args>
+	static Target* rebuild(Node* node, Args... args);
+	template<typename Node>
+	static AVLNode* to_avl(std::vector<Node*>& nodes, size_t lo, size_t hi);
+	template<typename Node>
+	TreapNode* to_treap(std::vector<Node*>& nodes, size_t lo, size_t hi);
+	template<typename Node>
+	static SplayNode* to_splay(std::vector<Node*>& nodes, size_t lo, size_t hi);
+	template<typename Node>
+	void move_nodes(Node*& root);
+};
+
+///////// Implementation Starts Here
+
+template<typename T, typename Compare>
+AdaptiveSet<T, Compare>::AdaptiveSet(bool _multiset, const Compare& _cmp)
+	: avl(_multiset, _cmp), treap(_multiset, _cmp), splay(_multiset, _cmp),
+	  current(Backing::avl), candidate(Backing::avl), rng(std::chrono::system_clock::now().time_since_epoch().count()),
+	  ops(0), reads(0), ranges(0), samples(0), repeats(0), recent() {
+	// Skewed reads are what the splay tree is picked for, so they splay
+	splay.set_policy(SplayPolicy::full, 0, true);
+}
+
+template<typename T, typename Compare>
+unsigned AdaptiveSet<T, Compare>::size() {
+	switch (current) {
+		case Backing::avl: return avl.size();
+		case Backing::treap: return treap.size();
+		case Backing::splay: return splay.size();
+	}
+	return 0;
+}
+
+template<typename T, typename Compare>
+bool AdaptiveSet<T, Compare>::empty() {
+	return size() == 0;
+}
+
+template<typename T, typename Compare>
+bool AdaptiveSet<T, Compare>::insert(const T& value) {
+	bool inserted = false;
+	switch (current) {
+		case Backing::avl: inserted = avl.insert(value); break;
+		case Backing::treap: inserted = treap.insert(value); break;
+		case Backing::splay: inserted = splay.insert(value); break;
+	}
+	count_op();
+	return inserted;
+}
+
+template<typename T, typename Compare>
+void AdaptiveSet<T, Compare>::erase(const T& value) {
+	switch (current) {
+		case Backing::avl: avl.erase(value); break;
+		case Backing::treap: treap.erase(value); break;
+		case Backing::splay: splay.erase(value); break;
+	}
+	count_op();
+}
+
+template<typename T, typename Compare>
+bool AdaptiveSet<T, Compare>::contains(const T& value) {
+	bool found = false;
+	switch (current) {
+		case Backing::avl: found = avl.contains(value); break;
+		case Backing::treap: found = treap.contains(value); break;
+		case Backing::splay: found = splay.contains(value); break;
+	}
+	if ((++reads & 15) == 0 && found)
+		sample(value);
+	count_op();
+	return found;
+}
+
+template<typename T, typename Compare>
+unsigned AdaptiveSet<T, Compare>::erase_range(const T& lo, const T& hi) {
+	unsigned removed = 0;
+	switch (current) {
+		case Backing::avl: removed = avl.erase_range(lo, hi); break;
+		case Backing::treap: removed = treap.erase_range(lo, hi); break;
+		case Backing::splay: removed = splay.erase_range(lo, hi); break;
+	}
+	ranges++;
+	count_op();
+	return removed;
+}
+
+// Moves the values from value on, or after it if after is set, into other.
+// other takes this set's backing first and loses what it held
+template<typename T, typename Compare>
+void AdaptiveSet<T, Compare>::split(const T& value, AdaptiveSet<T, Compare>& other, bool after) {
+	// Emptied before the convert so it has nothing to move
+	switch (other.current) {
+		case Backing::avl: other.avl.clear(); break;
+		case Backing::treap: other.treap.clear(); break;
+		case Backing::splay: other.splay.clear(); break;
+	}
+	other.convert(current);
+	// The keys other sampled were of what it held before
+	std::fill(std::begin(other.recent), std::end(other.recent), 0);
+	switch (current) {
+		case Backing::avl: avl.split(value, other.avl, after); break;
+		case Backing::treap: treap.split(value, other.treap, after); break;
+		case Backing::splay: splay.split(value, other.splay, after); break;
+	}
+	ranges++;
+	count_op();
+}
+
+// Appends the values of other, which must all be greater than this set's, and
+// leaves other empty. Returns false if they are not, with both sets unchanged
+// apart from other taking this set's backing
+template<typename T, typename Compare>
+bool AdaptiveSet<T, Compare>::join(AdaptiveSet<T, Compare>& other) {
+	other.convert(current);
+	bool joined = true;
+	switch (current) {
+		case Backing::avl:
+			joined = avl.join(other.avl);
+			break;
+		case Backing::treap:
+			if ((joined = ordered(treap, other.treap)))
+				treap.join(other.treap);
+			break;
+		case Backing::splay:
+			if ((joined = ordered(splay, other.splay)))
+				splay.join(other.splay);
+			break;
+	}
+	ranges++;
+	count_op();
+	return joined;
+}
+
+// Whether every value of left is below every value of right
+template<typename T, typename Compare>
+template<typename Tree>
+bool AdaptiveSet<T, Compare>::ordered(Tree& left, Tree& right) {
+	return left.empty() || right.empty() || left.cmp(left.max(), right.min());
+}
+
+// Ranges erased before a conversion stay parked in the tree that held them
+template<typename T, typename Compare>
+size_t AdaptiveSet<T, Compare>::reclaim(size_t budget) {
+	size_t freed = avl.reclaim(budget);
+	freed += treap.reclaim(budget - freed);
+	freed += splay.reclaim(budget - freed);
+	return freed;
+}
+
+template<typename T, typename Compare>
+Backing AdaptiveSet<T, Compare>::backing() {
+	return current;
+}
+
+template<typename T, typename Compare>
+void AdaptiveSet<T, Compare>::count_op() {
+	if (++ops >= min_window && ops >= size())
+		adapt();
+}
+
+// A sampled key counts as a repeat if it was among the recently sampled ones.
+// Only the hash of the key is kept, so erases, conversions and freed nodes
+// leave the table valid
+template<typename T, typename Compare>
+void AdaptiveSet<T, Compare>::sample(const T& value) {
+	uint64_t h = helper_methods::digest(value, 0) | 1;
+	uint64_t& slot = recent[h & 255];
+	repeats += (slot == h);
+	slot = h;
+	samples++;
+}
+
+template<typename T, typename Compare>
+void AdaptiveSet<T, Compare>::adapt() {
+	Backing verdict = Backing::avl;
+	if (ranges > range_share * ops)
+		verdict = Backing::treap;
+	else if (reads > read_share * ops && samples > 0 && repeats > skew_share * samples)
+		verdict = Backing::splay;
+
+	if (verdict != current && verdict == candidate)
+		convert(verdict);
+	candidate = verdict;
+	ops = reads = ranges = samples = repeats = 0;
+}
+
+// Moves the contents to the target tree in O(n), each node is rebuilt in
+// place and linked into a balanced shape
+template<typename T, typename Compare>
+void AdaptiveSet<T, Compare>::convert(Backing target) {
+	if (target == current) return;
+	switch (current) {
+		case Backing::avl: current = target; move_nodes(avl.root); avl.leftmost = avl.rightmost = nullptr; break;
+		case Backing::treap: current = target; move_nodes(treap.root); treap.leftmost = treap.rightmost = nullptr; break;
+		case Backing::splay: current = target; move_nodes(splay.root); splay.leftmost = splay.rightmost = nullptr; break;
+	}
+}
+
+template<typename T, typename Compare>
+template<typename Node>
+void AdaptiveSet<T, Compare>::move_nodes(Node*& root) {
+	std::vector<Node*> nodes = detach(root);
+	switch (current) {
+		case Backing::avl: avl.root = to_avl(nodes, 0, nodes.size()); break;
+		case Backing::treap: treap.root = to_treap(nodes, 0, nodes.size()); break;
+		case Backing::splay: splay.root = to_splay(nodes, 0, nodes.size()); break;
+	}
+}
+
+template<typename T, typename Compare>
+template<typename Node>
+void AdaptiveSet<T, Compare>::collect(Node* root, std::vector<Node*>& nodes) {
+	std::vector<Node*> stk;
+	Node* at = root;
+	while (at != nullptr || !stk.empty()) {
+		while (at != nullptr) {
+			stk.push_back(at);
+			at = at->left;
+		}
+		at = stk.back();
+		stk.pop_back();
+		nodes.push_back(at);
+		at = at->right;
+	}
+}
+
+// The nodes of the tree in order, the tree is left empty
+template<typename T, typename Compare>
+template<typename Node>
+std::vector<Node*> AdaptiveSet<T, Compare>::detach(Node*& root) {
+	std::vector<Node*> nodes;
+	nodes.reserve(root == nullptr ? 0 : root->size);
+	collect(root, nodes);
+	root = nullptr;
+	return nodes;
+}
+
+// Ends the life of node and constructs a Target from its value and args in
+// the same slot. The old links are dropped, the caller relinks the new node
+template<typename T, typename Compare>
+template<typename Target, typename Node, typename... Args>
+Target* AdaptiveSet<T, Compare>::rebuild(Node* node, Args... args) {
+	T value = std::move(node->value);
+	node->~Node();
+	return ::new ((void*) node) Target(std::move(value), args...);
+}
+
+template<typename T, typename Compare>
+template<typename Node>
+typename AdaptiveSet<T, Compare>::AVLNode* AdaptiveSet<T, Compare>::to_avl(std::vector<Node*>& nodes, size_t lo, size_t hi) {
+	if (lo == hi) return nullptr;
+	size_t mid = lo + (hi - lo) / 2;
+	AVLNode *left = to_avl(nodes, lo, mid);
+	AVLNode *node = rebuild<AVLNode>(nodes[mid], nodes[mid]->count);
+	node->left = left;
+	node->right = to_avl(nodes, mid + 1, hi);
+	node->update_parameters();
+	return node;
+}
+
+template<typename T, typename Compare>
+template<typename Node>
+typename AdaptiveSet<T, Compare>::TreapNode* AdaptiveSet<T, Compare>::to_treap(std::vector<Node*>& nodes, size_t lo, size_t hi) {
+	if (lo == hi) return nullptr;
+	size_t mid = lo + (hi - lo) / 2;
+	TreapNode *left = to_treap(nodes, lo, mid);
+	TreapNode *node = rebuild<TreapNode>(nodes[mid], nodes[mid]->count, (unsigned) rng());
+	node->left = left;
+	node->right = to_treap(nodes, mid + 1, hi);
+	node->update_parameters();
+	helper_methods::heapify(node, treap.cmp);
+	return node;
+}
+
+template<typename T, typename Compare>
+template<typename Node>
+typename AdaptiveSet<T, Compare>::SplayNode* AdaptiveSet<T, Compare>::to_splay(std::vector<Node*>& nodes, size_t lo, size_t hi) {
+	if (lo == hi) return nullptr;
+	size_t mid = lo + (hi - lo) / 2;
+	SplayNode *left = to_splay(nodes, lo, mid);
+	unsigned count = nodes[mid]->count;
+	SplayNode *node = rebuild<SplayNode>(nodes[mid]);
+	node->count = count;
+	node->set_left(left);
+	node->set_right(to_splay(nodes, mid + 1, hi));
+	return node;
+}
+
+#endif
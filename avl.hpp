@@ -1,84 +1,161 @@
 #ifndef AVL_HPP
 #define AVL_HPP
 
+#include <functional>
 #include <utility>
 #include <iostream>
 #include <stdexcept>
 #include <stack>
+#include <vector>
+#include "parallel.hpp"
+#include "deferred_free.hpp"
+#include "compare.hpp"
+#include "health.hpp"
 
-template<typename T>
+template<typename T, typename Compare>
+class AdaptiveSet;
+
+template<typename T, typename Compare = std::less<T>, size_t Slot = 0>
 class AVL {
   public:
 	struct Node {
 		T value;
+		unsigned count;
 		unsigned size;
 		unsigned height;
 		Node *left, *right;
-		Node(T _value = T()) : value(_value), size(1), height(1), 
+		Node(T _value = T(), unsigned _count = 1) : value(_value), count(_count), size(_count), height(1),
 							   left(nullptr), right(nullptr) {}
 		void update_parameters();
 		void set_left(Node* x);
 		void set_right(Node* x);
+		// At least Slot bytes each, so AdaptiveSet can rebuild a node of another tree in place
+		static void* operator new(size_t bytes) { return ::operator new(std::max(bytes, Slot)); }
+		static void operator delete(void* p) { ::operator delete(p); }
 	};
 
-	AVL();
-	AVL(Node*);
+	AVL(bool _multiset = false, const Compare& _cmp = Compare());
+	AVL(Node*, bool _multiset = false, const Compare& _cmp = Compare());
+	AVL(const AVL<T, Compare, Slot>& other);
+	AVL(AVL<T, Compare, Slot>&& other);
 	~AVL();
+	AVL<T, Compare, Slot>& operator=(const AVL<T, Compare, Slot>& other);
+	AVL<T, Compare, Slot>& operator=(AVL<T, Compare, Slot>&& other);
+	void swap(AVL<T, Compare, Slot>& other);
+	AVL<T, Compare, Slot> clone(unsigned threads = __parallel_helper_methods::default_threads());
 	unsigned height();
 	unsigned size();
 	bool empty();
+	void clear();
+	template<typename Iterator>
+	void build(Iterator first, Iterator last, unsigned threads = __parallel_helper_methods::default_threads());
 	bool insert(const T& value);
 	bool erase(const T& value);
+	bool erase_one(const T& value);
+	unsigned erase_all(const T& value);
+	unsigned count(const T& value);
 	bool contains(const T& value);
+	// Heterogeneous lookups, see compare.hpp
+	template<typename K, typename C = Compare, typename = typename C::is_transparent>
+	unsigned count(const K& key);
+	template<typename K, typename C = Compare, typename = typename C::is_transparent>
+	bool contains(const K& key);
+	const T& kth(unsigned k);
+	unsigned rank(const T& value);
+	const T& min();
+	const T& max();
+	T pop_min();
+	T pop_max();
+	template<typename F>
+	void parallel_for_each(F f, unsigned threads = __parallel_helper_methods::default_threads());
+	template<typename R, typename Map, typename Combine>
+	R parallel_reduce(R identity, Map map, Combine combine, unsigned threads = __parallel_helper_methods::default_threads());
+	template<typename Pred>
+	AVL<T, Compare, Slot> parallel_filter(Pred pred, unsigned threads = __parallel_helper_methods::default_threads());
 	bool join_aux(Node* other);
-	bool join(AVL<T>& other);
+	bool join(AVL<T, Compare, Slot>& other);
 	std::pair<bool,Node*> split(const T& value);
+	void split(const T& value, AVL<T, Compare, Slot>& other, bool after=false);
+	AVL<T, Compare, Slot> extract_range(const T& lo, const T& hi);
+	unsigned erase_range(const T& lo, const T& hi);
+	size_t reclaim(size_t budget = (size_t) -1);
+	TreeHealth& health();
+	ShapeReport shape_report();
+	bool poll();
+	bool verify();
 	void print();
 
   private:
+	friend class AdaptiveSet<T, Compare>;
 	static void grab_pointers(std::stack<Node*>& stk, Node* at);
+	template<typename K>
+	Node* find(const K& key);
+	Node* min_node();
+	Node* max_node();
+	void forget_end(Node* p);
+	T pop(bool smallest);
+	bool join_aux(Node* other, Node* other_min, Node* other_max);
+	static Node* build(const T* values, const unsigned* counts, size_t lo, size_t hi, unsigned threads);
 	Node* rebalance(Node* p);
 	Node* rotate_right(Node* p);
 	Node* rotate_left(Node* p);
 	Node* rotate_right_left(Node* p);
 	Node* rotate_left_right(Node* p);
-	Node* insert(Node* p, const T& value);
-	Node* erase(Node* p, const T& value, Node* par);
-	Node* join_right(Node* l, const T& k, Node* r);
-	Node* join_left(Node* l, const T& k, Node* r);
-	Node* join(Node* l, const T& k, Node* r);
-	Node* split(Node* p, const T& value);
+	Node* insert(Node* p, const T& value, Node*& created);
+	Node* erase(Node* p, const T& value);
+	Node* join_right(Node* l, Node* k, Node* r);
+	Node* join_left(Node* l, Node* k, Node* r);
+	Node* join(Node* l, Node* k, Node* r);
+	Node* split_first(Node* p, Node*& first);
+	Node* split_last(Node* p, Node*& last);
+	template<typename Pred>
+	Node* parallel_filter(Node* p, Pred& pred, unsigned threads);
+	std::pair<Node*,Node*> split(Node* p, const T& value, bool after);
+	int verify(Node* p, const T* lo, const T* hi);
 	void print(const std::string& prefix, Node* p, bool isLeft);
 	Node *root;
+	bool multiset; // keeps one node per key with a multiplicity counter
+	Compare cmp;
+	Node *leftmost, *rightmost; // see compare.hpp
+	DeferredFree<Node> graveyard;
+	TreeHealth monitor; // off until enabled, stays with this object through moves and swaps
 };
 
+namespace __avl_helper_methods {
+	template<typename Node>
+	int get_height(Node *node);
+
+	template<typename Node>
+	int get_size(Node *node);
+}
+
 // NODE
 // ----
 
-template<typename T>
-int get_height(typename AVL<T>::Node *node) {
+template<typename Node>
+int __avl_helper_methods::get_height(Node *node) {
 	return (node == nullptr ? 0 : (int) node->height);
 }
 
-template<typename T>
-int get_size(typename AVL<T>::Node *node) {
+template<typename Node>
+int __avl_helper_methods::get_size(Node *node) {
 	return (node == nullptr ? 0 : (int) node->size);
 }
 
-template<typename T>
-void AVL<T>::Node::update_parameters() {
-	this->size = 1 + get_size<T>(left) + get_size<T>(right);
-	this->height = 1 + std::max(get_height<T>(left), get_height<T>(right));
+template<typename T, typename Compare, size_t Slot>
+void AVL<T, Compare, Slot>::Node::update_parameters() {
+	this->size = count + __avl_helper_methods::get_size(left) + __avl_helper_methods::get_size(right);
+	this->height = 1 + std::max(__avl_helper_methods::get_height(left), __avl_helper_methods::get_height(right));
 }
 
-template<typename T>
-void AVL<T>::Node::set_right(AVL<T>::Node* x) {
+template<typename T, typename Compare, size_t Slot>
+void AVL<T, Compare, Slot>::Node::set_right(AVL<T, Compare, Slot>::Node* x) {
 	right = x;
 	update_parameters();
 }
 
-template<typename T>
-void AVL<T>::Node::set_left(AVL<T>::Node* x) {
+template<typename T, typename Compare, size_t Slot>
+void AVL<T, Compare, Slot>::Node::set_left(AVL<T, Compare, Slot>::Node* x) {
 	left = x;
 	update_parameters();
 }
@@ -86,48 +163,154 @@ void AVL<T>::Node::set_left(AVL<T>::Node* x) {
 // AVL
 // ---
 
-template<typename T>
-void AVL<T>::grab_pointers(std::stack<AVL<T>::Node*>& stk, AVL<T>::Node* at) {
+template<typename T, typename Compare, size_t Slot>
+void AVL<T, Compare, Slot>::grab_pointers(std::stack<AVL<T, Compare, Slot>::Node*>& stk, AVL<T, Compare, Slot>::Node* at) {
 	if (at == nullptr) return;
 	grab_pointers(stk, at->left);
 	stk.push(at);
 	grab_pointers(stk, at->right);
 }
 
-template<typename T>
-AVL<T>::AVL() : root(nullptr) {}
+template<typename T, typename Compare, size_t Slot>
+AVL<T, Compare, Slot>::AVL(bool _multiset, const Compare& _cmp) : root(nullptr), multiset(_multiset), cmp(_cmp),
+                                                                 leftmost(nullptr), rightmost(nullptr) {}
+
+template<typename T, typename Compare, size_t Slot>
+AVL<T, Compare, Slot>::AVL(AVL<T, Compare, Slot>::Node* at, bool _multiset, const Compare& _cmp) : root(at), multiset(_multiset),
+                                                                                          cmp(_cmp), leftmost(nullptr), rightmost(nullptr) {}
+
+template<typename T, typename Compare, size_t Slot>
+AVL<T, Compare, Slot>::AVL(const AVL<T, Compare, Slot>& other) : root(__parallel_helper_methods::clone(other.root, 1)), multiset(other.multiset),
+                                                    cmp(other.cmp), leftmost(nullptr), rightmost(nullptr) {}
+
+template<typename T, typename Compare, size_t Slot>
+AVL<T, Compare, Slot>::AVL(AVL<T, Compare, Slot>&& other) : root(other.root), multiset(other.multiset), cmp(other.cmp),
+                                               leftmost(other.leftmost), rightmost(other.rightmost),
+                                               graveyard(std::move(other.graveyard)) {
+	other.root = other.leftmost = other.rightmost = nullptr;
+}
+
+template<typename T, typename Compare, size_t Slot>
+AVL<T, Compare, Slot>& AVL<T, Compare, Slot>::operator=(const AVL<T, Compare, Slot>& other) {
+	if (this != &other) {
+		AVL<T, Compare, Slot> copy(other);
+		swap(copy);
+	}
+	return *this;
+}
+
+template<typename T, typename Compare, size_t Slot>
+AVL<T, Compare, Slot>& AVL<T, Compare, Slot>::operator=(AVL<T, Compare, Slot>&& other) {
+	if (this != &other) {
+		clear();
+		swap(other);
+	}
+	return *this;
+}
+
+template<typename T, typename Compare, size_t Slot>
+void AVL<T, Compare, Slot>::swap(AVL<T, Compare, Slot>& other) {
+	std::swap(root, other.root);
+	std::swap(multiset, other.multiset);
+	std::swap(cmp, other.cmp);
+	std::swap(leftmost, other.leftmost);
+	std::swap(rightmost, other.rightmost);
+	graveyard.swap(other.graveyard);
+}
+
+// Copies the nodes directly, subtrees are copied in parallel while threads remain
+template<typename T, typename Compare, size_t Slot>
+AVL<T, Compare, Slot> AVL<T, Compare, Slot>::clone(unsigned threads) {
+	return AVL<T, Compare, Slot>(__parallel_helper_methods::clone(root, std::max(1u, threads)), multiset, cmp);
+}
 
-template<typename T>
-AVL<T>::AVL(AVL<T>::Node* at) : root(at) {}
+template<typename T, typename Compare, size_t Slot>
+AVL<T, Compare, Slot>::~AVL() {
+	clear();
+}
 
-template<typename T>
-AVL<T>::~AVL() {
-	std::stack<typename AVL<T>::Node*> pointers;
+template<typename T, typename Compare, size_t Slot>
+void AVL<T, Compare, Slot>::clear() {
+	std::stack<typename AVL<T, Compare, Slot>::Node*> pointers;
 	grab_pointers(pointers, this->root);
 	while (not pointers.empty()) {
 		delete pointers.top();
 		pointers.pop();
 	}
+	this->root = this->leftmost = this->rightmost = nullptr;
+}
+
+// Replaces the contents with the values in [first, last), which may be unsorted
+// and have duplicates. Sorting, deduplication and the construction of the
+// balanced tree are all split among the given number of threads
+template<typename T, typename Compare, size_t Slot>
+template<typename Iterator>
+void AVL<T, Compare, Slot>::build(Iterator first, Iterator last, unsigned threads) {
+	clear();
+	threads = std::max(1u, threads);
+	std::vector<T> values(first, last), buffer(values.size());
+	std::vector<unsigned> counts(multiset ? values.size() : 0);
+	T* begin = values.data();
+	__parallel_helper_methods::sort(begin, begin + values.size(), buffer.data(), cmp, threads);
+	size_t distinct = __parallel_helper_methods::unique_runs(begin, begin + values.size(), buffer.data(),
+	                                                         (multiset ? counts.data() : nullptr), cmp, threads);
+	root = build(buffer.data(), (multiset ? counts.data() : nullptr), 0, distinct, threads);
+}
+
+// Each subtree is allocated by the thread that builds it
+template<typename T, typename Compare, size_t Slot>
+typename AVL<T, Compare, Slot>::Node* AVL<T, Compare, Slot>::build(const T* values, const unsigned* counts, size_t lo, size_t hi, unsigned threads) {
+	if (lo == hi) return nullptr;
+	if (hi - lo < __parallel_helper_methods::grain) threads = 1;
+	size_t mid = lo + (hi - lo) / 2;
+	typename AVL<T, Compare, Slot>::Node *p = new typename AVL<T, Compare, Slot>::Node(values[mid], (counts ? counts[mid] : 1));
+	__parallel_helper_methods::fork(threads,
+		[&] { p->left = build(values, counts, lo, mid, threads / 2); },
+		[&] { p->right = build(values, counts, mid + 1, hi, threads - threads / 2); });
+	p->update_parameters();
+	return p;
 }
 
-template<typename T>
-unsigned AVL<T>::height() {
+template<typename T, typename Compare, size_t Slot>
+unsigned AVL<T, Compare, Slot>::height() {
 	return (this->root == nullptr ? 0 : this->root->height);
 }
 
-template<typename T>
-unsigned AVL<T>::size() {
+template<typename T, typename Compare, size_t Slot>
+unsigned AVL<T, Compare, Slot>::size() {
 	return (this->root == nullptr ? 0 : this->root->size);
 }
 
-template<typename T>
-bool AVL<T>::empty() {
+template<typename T, typename Compare, size_t Slot>
+bool AVL<T, Compare, Slot>::empty() {
 	return (this->root == nullptr);
 }
 
-template<typename T>
-typename AVL<T>::Node* AVL<T>::rotate_left(typename AVL<T>::Node *p) {
-	typename AVL<T>::Node *q = p->right;
+template<typename T, typename Compare, size_t Slot>
+TreeHealth& AVL<T, Compare, Slot>::health() {
+	return monitor;
+}
+
+template<typename T, typename Compare, size_t Slot>
+ShapeReport AVL<T, Compare, Slot>::shape_report() {
+	ShapeReport report = __health_helper_methods::shape_of(root, size(), std::max(sizeof(Node), Slot));
+	monitor.observe(report);
+	return report;
+}
+
+// Settles a drift the sampled operations left pending with one shape report,
+// and returns whether it ran the drift callback. O(1) with none pending
+template<typename T, typename Compare, size_t Slot>
+bool AVL<T, Compare, Slot>::poll() {
+	if (!monitor.pending())
+		return false;
+	ShapeReport report = __health_helper_methods::shape_of(root, size(), std::max(sizeof(Node), Slot));
+	return monitor.observe(report);
+}
+
+template<typename T, typename Compare, size_t Slot>
+typename AVL<T, Compare, Slot>::Node* AVL<T, Compare, Slot>::rotate_left(typename AVL<T, Compare, Slot>::Node *p) {
+	typename AVL<T, Compare, Slot>::Node *q = p->right;
 	p->right = q->left;
 	q->left = p;
 	p->update_parameters();
@@ -135,9 +318,9 @@ typename AVL<T>::Node* AVL<T>::rotate_left(typename AVL<T>::Node *p) {
 	return q;
 }
 
-template<typename T>
-typename AVL<T>::Node* AVL<T>::rotate_right(typename AVL<T>::Node *p) {
-	typename AVL<T>::Node *q = p->left;
+template<typename T, typename Compare, size_t Slot>
+typename AVL<T, Compare, Slot>::Node* AVL<T, Compare, Slot>::rotate_right(typename AVL<T, Compare, Slot>::Node *p) {
+	typename AVL<T, Compare, Slot>::Node *q = p->left;
 	p->left = q->right;
 	q->right = p;
 	p->update_parameters();
@@ -145,28 +328,28 @@ typename AVL<T>::Node* AVL<T>::rotate_right(typename AVL<T>::Node *p) {
 	return q;
 }
 
-template<typename T>
-typename AVL<T>::Node* AVL<T>::rotate_left_right(typename AVL<T>::Node *p) {
+template<typename T, typename Compare, size_t Slot>
+typename AVL<T, Compare, Slot>::Node* AVL<T, Compare, Slot>::rotate_left_right(typename AVL<T, Compare, Slot>::Node *p) {
 	p->left = rotate_left(p->left);
 	return rotate_right(p);
 }
 
-template<typename T>
-typename AVL<T>::Node* AVL<T>::rotate_right_left(typename AVL<T>::Node *p) {
+template<typename T, typename Compare, size_t Slot>
+typename AVL<T, Compare, Slot>::Node* AVL<T, Compare, Slot>::rotate_right_left(typename AVL<T, Compare, Slot>::Node *p) {
 	p->right = rotate_right(p->right);
 	return rotate_left(p);
 }
 
-template<typename T>
-typename AVL<T>::Node* AVL<T>::rebalance(typename AVL<T>::Node *p) {
+template<typename T, typename Compare, size_t Slot>
+typename AVL<T, Compare, Slot>::Node* AVL<T, Compare, Slot>::rebalance(typename AVL<T, Compare, Slot>::Node *p) {
 	if (p == nullptr) return p;
-	if (get_height<T>(p->left) - get_height<T>(p->right) > 1) {
-		if (get_height<T>(p->left->left) >= get_height<T>(p->left->right))
+	if (__avl_helper_methods::get_height(p->left) - __avl_helper_methods::get_height(p->right) > 1) {
+		if (__avl_helper_methods::get_height(p->left->left) >= __avl_helper_methods::get_height(p->left->right))
 			p = rotate_right(p);
 		else
 			p = rotate_left_right(p);
-	} else if (get_height<T>(p->right) - get_height<T>(p->left) > 1) {
-		if (get_height<T>(p->right->right) >= get_height<T>(p->right->left))
+	} else if (__avl_helper_methods::get_height(p->right) - __avl_helper_methods::get_height(p->left) > 1) {
+		if (__avl_helper_methods::get_height(p->right->right) >= __avl_helper_methods::get_height(p->right->left))
 			p = rotate_left(p);
 		else
 			p = rotate_right_left(p);
@@ -175,207 +358,505 @@ typename AVL<T>::Node* AVL<T>::rebalance(typename AVL<T>::Node *p) {
 	return p;
 }
 
-template<typename T>
-typename AVL<T>::Node* AVL<T>::insert(typename AVL<T>::Node *p, const T& value) {
+template<typename T, typename Compare, size_t Slot>
+typename AVL<T, Compare, Slot>::Node* AVL<T, Compare, Slot>::insert(typename AVL<T, Compare, Slot>::Node *p, const T& value,
+                                                        typename AVL<T, Compare, Slot>::Node*& created) {
 	if (p == nullptr)
-		p = new typename AVL<T>::Node(value);
-	else if (value < p->value)
-		p->left = insert(p->left, value);
-	else if (value > p->value)
-		p->right = insert(p->right, value);
+		return created = new typename AVL<T, Compare, Slot>::Node(value);
+	int c = __compare_helper_methods::compare(cmp, value, p->value);
+	if (c < 0)
+		p->left = insert(p->left, value, created);
+	else if (c > 0)
+		p->right = insert(p->right, value, created);
+	else if (multiset)
+		p->count++;
 	else
 		throw std::invalid_argument("Repeated value!");
 	return rebalance(p);
 }
 
-template<typename T>
-bool AVL<T>::insert(const T& value) {
+template<typename T, typename Compare, size_t Slot>
+bool AVL<T, Compare, Slot>::insert(const T& value) {
+	HealthProbe<AVL<T, Compare, Slot>> probe(*this, TreeOp::insert);
+	typename AVL<T, Compare, Slot>::Node *created = nullptr;
 	try {
-		root = insert(root, value);
+		root = insert(root, value, created);
 	} catch (const std::invalid_argument& e) {
 		return false;
 	}
+	if (created != nullptr) {
+		if (leftmost != nullptr && cmp(value, leftmost->value))
+			leftmost = created;
+		if (rightmost != nullptr && cmp(rightmost->value, value))
+			rightmost = created;
+	}
 	return true;
 }
 
-template<typename T>
-typename AVL<T>::Node* AVL<T>::erase(typename AVL<T>::Node *p, const T& value, typename AVL<T>::Node* parent) {
+// The node is unlinked and replaced by its successor node rather than
+// overwritten, so pointers to every other node stay valid
+template<typename T, typename Compare, size_t Slot>
+typename AVL<T, Compare, Slot>::Node* AVL<T, Compare, Slot>::erase(typename AVL<T, Compare, Slot>::Node *p, const T& value) {
 	if (p == nullptr)
 		return p;
-	else if (value < p->value)
-		p->left = erase(p->left, value, p);
-	else if (value > p->value)
-		p->right = erase(p->right, value, p);
+	int c = __compare_helper_methods::compare(cmp, value, p->value);
+	if (c < 0)
+		p->left = erase(p->left, value);
+	else if (c > 0)
+		p->right = erase(p->right, value);
 	else {
-		if (p->left == nullptr) {
-			if (p->right == nullptr) {
-				if (parent && parent->left == p) parent->left = nullptr;
-				if (parent && parent->right == p) parent->right = nullptr;
-				delete p; p = nullptr;
-			} else {
-				typename AVL<T>::Node *tmp = p->right;
-				*p = *tmp;
-				delete tmp;
-			}
-		} else if (p->right == nullptr) {
-			typename AVL<T>::Node *tmp = p->left;
-			*p = *tmp;
-			delete tmp;
-		} else {
-			typename AVL<T>::Node *q = p->right;
-			while (q->left != nullptr)
-				q = q->left;
-			p->value = q->value;
-			p->right = erase(p->right, p->value, p);
-		}
+		typename AVL<T, Compare, Slot>::Node *left = p->left, *right = p->right;
+		delete p;
+		if (right == nullptr)
+			return left;
+		right = split_first(right, p);
+		p->left = left;
+		p->right = right; // p is now the successor
 	}
-	if (p == nullptr)
-		return p;
 	p->update_parameters();
 	return rebalance(p);
 }
 
-template<typename T>
-bool AVL<T>::erase(const T& value) {
-	if (!contains(value)) return false;
-	root = erase(root, value, nullptr);
+// Removes every copy of value, like erase_all, and returns whether there was any
+template<typename T, typename Compare, size_t Slot>
+bool AVL<T, Compare, Slot>::erase(const T& value) {
+	HealthProbe<AVL<T, Compare, Slot>> probe(*this, TreeOp::erase);
+	typename AVL<T, Compare, Slot>::Node *p = find(value);
+	if (p == nullptr) return false;
+	forget_end(p);
+	root = erase(root, value);
+	return true;
+}
+
+template<typename T, typename Compare, size_t Slot>
+bool AVL<T, Compare, Slot>::erase_one(const T& value) {
+	HealthProbe<AVL<T, Compare, Slot>> probe(*this, TreeOp::erase);
+	typename AVL<T, Compare, Slot>::Node *p = find(value);
+	if (p == nullptr) return false;
+	if (p->count == 1) {
+		forget_end(p);
+		root = erase(root, value);
+		return true;
+	}
+	// Only the sizes along the search path change, the shape stays the same
+	p = root;
+	while (true) {
+		p->size--;
+		int c = __compare_helper_methods::compare(cmp, value, p->value);
+		if (c == 0) break;
+		if (c < 0)
+			p = p->left;
+		else
+			p = p->right;
+	}
+	p->count--;
 	return true;
 }
 
-template<typename T>
-bool AVL<T>::contains(const T& value) {
-	typename AVL<T>::Node *p = root;
+template<typename T, typename Compare, size_t Slot>
+unsigned AVL<T, Compare, Slot>::erase_all(const T& value) {
+	HealthProbe<AVL<T, Compare, Slot>> probe(*this, TreeOp::erase);
+	typename AVL<T, Compare, Slot>::Node *p = find(value);
+	if (p == nullptr) return 0;
+	unsigned removed = p->count;
+	forget_end(p);
+	root = erase(root, value);
+	return removed;
+}
+
+template<typename T, typename Compare, size_t Slot>
+template<typename K>
+typename AVL<T, Compare, Slot>::Node* AVL<T, Compare, Slot>::find(const K& key) {
+	typename AVL<T, Compare, Slot>::Node *p = root;
 	while (p != nullptr) {
-		if (value == p->value) return true;
-		if (value < p->value)
+		int c = __compare_helper_methods::compare(cmp, key, p->value);
+		if (c == 0) return p;
+		if (c < 0)
 			p = p->left;
 		else
 			p = p->right;
 	}
-	return false;
+	return nullptr;
 }
 
-template<typename T>
-typename AVL<T>::Node* AVL<T>::join_left(typename AVL<T>::Node* tl, const T& k, typename AVL<T>::Node* tr) {
-	auto [value, size, height, left, right] = *tr; delete tr;
+template<typename T, typename Compare, size_t Slot>
+unsigned AVL<T, Compare, Slot>::count(const T& value) {
+	HealthProbe<AVL<T, Compare, Slot>> probe(*this, TreeOp::lookup);
+	typename AVL<T, Compare, Slot>::Node *p = find(value);
+	return (p == nullptr ? 0 : p->count);
+}
 
-	if (left->height <= tl->height + 1) {
-		typename AVL<T>::Node *aux = new typename AVL<T>::Node(k);
-		aux->set_left(tl); aux->set_right(left); aux->update_parameters();
-		if (aux->height <= right->height + 1) {
-			typename AVL<T>::Node *ret = new typename AVL<T>::Node(value);
-			ret->set_left(aux); ret->set_right(right); ret->update_parameters();
-			return ret;
+template<typename T, typename Compare, size_t Slot>
+bool AVL<T, Compare, Slot>::contains(const T& value) {
+	HealthProbe<AVL<T, Compare, Slot>> probe(*this, TreeOp::lookup);
+	return find(value) != nullptr;
+}
+
+template<typename T, typename Compare, size_t Slot>
+template<typename K, typename C, typename>
+unsigned AVL<T, Compare, Slot>::count(const K& key) {
+	HealthProbe<AVL<T, Compare, Slot>> probe(*this, TreeOp::lookup);
+	typename AVL<T, Compare, Slot>::Node *p = find(key);
+	return (p == nullptr ? 0 : p->count);
+}
+
+template<typename T, typename Compare, size_t Slot>
+template<typename K, typename C, typename>
+bool AVL<T, Compare, Slot>::contains(const K& key) {
+	HealthProbe<AVL<T, Compare, Slot>> probe(*this, TreeOp::lookup);
+	return find(key) != nullptr;
+}
+
+template<typename T, typename Compare, size_t Slot>
+const T& AVL<T, Compare, Slot>::kth(unsigned k) {
+	if (k >= size())
+		throw std::out_of_range("Index out of range!");
+	typename AVL<T, Compare, Slot>::Node *p = root;
+	while (true) {
+		unsigned left_size = __avl_helper_methods::get_size(p->left);
+		if (k < left_size) {
+			p = p->left;
+		} else if (k < left_size + p->count) {
+			return p->value;
 		} else {
-			typename AVL<T>::Node *ret = new typename AVL<T>::Node(value);
-			ret->set_left(rotate_left(aux)); ret->set_right(right); ret->update_parameters();
-			return rotate_right(ret);
+			k -= left_size + p->count;
+			p = p->right;
 		}
 	}
+}
 
-	else {
-		typename AVL<T>::Node *aux = join_left(tl, k, left);
-		typename AVL<T>::Node *auxaux = new typename AVL<T>::Node(value);
-		auxaux->set_left(aux); auxaux->set_right(right); auxaux->update_parameters();
-		if (aux->height <= right->height + 1)
-			return auxaux;
-		else
-			return rotate_right(auxaux);
+template<typename T, typename Compare, size_t Slot>
+unsigned AVL<T, Compare, Slot>::rank(const T& value) {
+	unsigned smaller = 0;
+	typename AVL<T, Compare, Slot>::Node *p = root;
+	while (p != nullptr) {
+		if (cmp(p->value, value)) {
+			smaller += __avl_helper_methods::get_size(p->left) + p->count;
+			p = p->right;
+		} else {
+			p = p->left;
+		}
 	}
+	return smaller;
 }
 
-template<typename T>
-typename AVL<T>::Node* AVL<T>::join_right(typename AVL<T>::Node* tl, const T& k, typename AVL<T>::Node* tr) {
-	auto [value, size, height, left, right] = *tl; delete tl;
+template<typename T, typename Compare, size_t Slot>
+typename AVL<T, Compare, Slot>::Node* AVL<T, Compare, Slot>::min_node() {
+	if (leftmost == nullptr && root != nullptr) {
+		leftmost = root;
+		while (leftmost->left != nullptr)
+			leftmost = leftmost->left;
+	}
+	return leftmost;
+}
 
-	if (right->height <= tr->height + 1) {
-		typename AVL<T>::Node *aux = new typename AVL<T>::Node(k);
-		aux->set_left(right); aux->set_right(tr); aux->update_parameters();
-		if (aux->height <= left->height + 1) {
-			typename AVL<T>::Node *ret = new typename AVL<T>::Node(value);
-			ret->set_left(left); ret->set_right(aux); ret->update_parameters();
-			return ret;
-		} else {
-			typename AVL<T>::Node *ret = new typename AVL<T>::Node(value);
-			ret->set_left(left); ret->set_right(rotate_right(aux)); ret->update_parameters();
-			return rotate_left(ret);
-		}
+template<typename T, typename Compare, size_t Slot>
+typename AVL<T, Compare, Slot>::Node* AVL<T, Compare, Slot>::max_node() {
+	if (rightmost == nullptr && root != nullptr) {
+		rightmost = root;
+		while (rightmost->right != nullptr)
+			rightmost = rightmost->right;
 	}
+	return rightmost;
+}
 
-	else {
-		typename AVL<T>::Node *aux = join_right(right, k, tr);
-		typename AVL<T>::Node *auxaux = new typename AVL<T>::Node(value);
-		auxaux->set_left(left); auxaux->set_right(aux); auxaux->update_parameters();
-		if (aux->height <= left->height + 1)
-			return auxaux;
-		else
-			return rotate_left(auxaux);
+// Called before p is deleted
+template<typename T, typename Compare, size_t Slot>
+void AVL<T, Compare, Slot>::forget_end(typename AVL<T, Compare, Slot>::Node *p) {
+	if (p == leftmost) leftmost = nullptr;
+	if (p == rightmost) rightmost = nullptr;
+}
+
+template<typename T, typename Compare, size_t Slot>
+const T& AVL<T, Compare, Slot>::min() {
+	if (empty())
+		throw std::out_of_range("Empty tree!");
+	return min_node()->value;
+}
+
+template<typename T, typename Compare, size_t Slot>
+const T& AVL<T, Compare, Slot>::max() {
+	if (empty())
+		throw std::out_of_range("Empty tree!");
+	return max_node()->value;
+}
+
+template<typename T, typename Compare, size_t Slot>
+T AVL<T, Compare, Slot>::pop_min() {
+	return pop(true);
+}
+
+template<typename T, typename Compare, size_t Slot>
+T AVL<T, Compare, Slot>::pop_max() {
+	return pop(false);
+}
+
+// Removes one copy of the smallest or largest value without comparing any
+// keys. Only the spine down to it is touched, and the next end is found on
+// the way, so the cache stays exact
+template<typename T, typename Compare, size_t Slot>
+T AVL<T, Compare, Slot>::pop(bool smallest) {
+	if (empty())
+		throw std::out_of_range("Empty tree!");
+	typename AVL<T, Compare, Slot>::Node *x = (smallest ? min_node() : max_node());
+	auto inner = [&](typename AVL<T, Compare, Slot>::Node* p) { return (smallest ? p->left : p->right); };
+	if (x->count > 1) {
+		for (typename AVL<T, Compare, Slot>::Node *p = root; p != x; p = inner(p))
+			p->size--;
+		x->count--;
+		x->size--;
+		return x->value;
+	}
+
+	// The next end is the outer child of x, a leaf in an AVL tree, or else its parent
+	typename AVL<T, Compare, Slot>::Node *next = (smallest ? x->right : x->left);
+	if (next == nullptr)
+		for (typename AVL<T, Compare, Slot>::Node *p = root; p != x; p = inner(p))
+			next = p;
+	root = (smallest ? split_first(root, x) : split_last(root, x));
+	(smallest ? leftmost : rightmost) = next;
+	if (root == nullptr)
+		leftmost = rightmost = nullptr;
+	T value = std::move(x->value);
+	delete x;
+	return value;
+}
+
+template<typename T, typename Compare, size_t Slot>
+typename AVL<T, Compare, Slot>::Node* AVL<T, Compare, Slot>::join_right(typename AVL<T, Compare, Slot>::Node* tl, typename AVL<T, Compare, Slot>::Node* k, typename AVL<T, Compare, Slot>::Node* tr) {
+	if (__avl_helper_methods::get_height(tl) <= __avl_helper_methods::get_height(tr) + 1) {
+		k->left = tl; k->right = tr; k->update_parameters();
+		return k;
 	}
+	tl->right = join_right(tl->right, k, tr);
+	return rebalance(tl);
 }
 
-template<typename T>
-typename AVL<T>::Node* AVL<T>::join(typename AVL<T>::Node* tl, const T& k, typename AVL<T>::Node* tr) {
-	if (tl->height > tr->height + 1)
+template<typename T, typename Compare, size_t Slot>
+typename AVL<T, Compare, Slot>::Node* AVL<T, Compare, Slot>::join_left(typename AVL<T, Compare, Slot>::Node* tl, typename AVL<T, Compare, Slot>::Node* k, typename AVL<T, Compare, Slot>::Node* tr) {
+	if (__avl_helper_methods::get_height(tr) <= __avl_helper_methods::get_height(tl) + 1) {
+		k->left = tl; k->right = tr; k->update_parameters();
+		return k;
+	}
+	tr->left = join_left(tl, k, tr->left);
+	return rebalance(tr);
+}
+
+template<typename T, typename Compare, size_t Slot>
+typename AVL<T, Compare, Slot>::Node* AVL<T, Compare, Slot>::join(typename AVL<T, Compare, Slot>::Node* tl, typename AVL<T, Compare, Slot>::Node* k, typename AVL<T, Compare, Slot>::Node* tr) {
+	if (__avl_helper_methods::get_height(tl) > __avl_helper_methods::get_height(tr) + 1)
 		return join_right(tl, k, tr);
-	if (tr->height > tl->height + 1)
+	if (__avl_helper_methods::get_height(tr) > __avl_helper_methods::get_height(tl) + 1)
 		return join_left(tl, k, tr);
-	typename AVL<T>::Node *ret = new typename AVL<T>::Node(k);
-	ret->set_left(tl); ret->set_right(tr); ret->update_parameters();
-	return ret;
+	k->left = tl; k->right = tr; k->update_parameters();
+	return k;
 }
 
-template<typename T>
-bool AVL<T>::join_aux(typename AVL<T>::Node *other) {
-	typename AVL<T>::Node *left_max = root->right;
-	while (left_max->right != nullptr)
-		left_max = left_max->right;
+template<typename T, typename Compare, size_t Slot>
+typename AVL<T, Compare, Slot>::Node* AVL<T, Compare, Slot>::split_first(typename AVL<T, Compare, Slot>::Node* p, typename AVL<T, Compare, Slot>::Node*& first) {
+	if (p->left == nullptr) {
+		first = p;
+		typename AVL<T, Compare, Slot>::Node *right = p->right;
+		p->right = nullptr; p->update_parameters();
+		return right;
+	}
+	p->left = split_first(p->left, first);
+	return rebalance(p);
+}
+
+template<typename T, typename Compare, size_t Slot>
+typename AVL<T, Compare, Slot>::Node* AVL<T, Compare, Slot>::split_last(typename AVL<T, Compare, Slot>::Node* p, typename AVL<T, Compare, Slot>::Node*& last) {
+	if (p->right == nullptr) {
+		last = p;
+		typename AVL<T, Compare, Slot>::Node *left = p->left;
+		p->left = nullptr; p->update_parameters();
+		return left;
+	}
+	p->right = split_last(p->right, last);
+	return rebalance(p);
+}
 
-	typename AVL<T>::Node *right_min = other->left;
+template<typename T, typename Compare, size_t Slot>
+bool AVL<T, Compare, Slot>::join_aux(typename AVL<T, Compare, Slot>::Node *other) {
+	if (other == nullptr) return true;
+	typename AVL<T, Compare, Slot>::Node *right_min = other;
 	while (right_min->left != nullptr)
 		right_min = right_min->left;
+	return join_aux(other, right_min, nullptr);
+}
 
-	if (left_max->value >= right_min->value)
-		return false;
-	// erase(left_max->value);
-	const T value = left_max->value;
-	delete left_max;
-	root = join(root, value, other);
+// other_min is the smallest node of other and other_max its largest, or null if unknown
+template<typename T, typename Compare, size_t Slot>
+bool AVL<T, Compare, Slot>::join_aux(typename AVL<T, Compare, Slot>::Node *other, typename AVL<T, Compare, Slot>::Node *other_min,
+                               typename AVL<T, Compare, Slot>::Node *other_max) {
+	if (root == nullptr) {
+		root = other;
+		leftmost = other_min;
+	} else {
+		if (!cmp(max_node()->value, other_min->value))
+			return false;
+		// The maximum of the left tree is reused as the joining key
+		typename AVL<T, Compare, Slot>::Node *k;
+		typename AVL<T, Compare, Slot>::Node *left = split_last(root, k);
+		root = join(left, k, other);
+	}
+	rightmost = other_max;
 	return true;
 }
 
-template<typename T>
-bool AVL<T>::join(AVL<T>& other) {
-	return join_aux(other.root);
+template<typename T, typename Compare, size_t Slot>
+bool AVL<T, Compare, Slot>::join(AVL<T, Compare, Slot>& other) {
+	if (other.root == nullptr) return true;
+	if (!join_aux(other.root, other.min_node(), other.rightmost)) return false;
+	other.root = other.leftmost = other.rightmost = nullptr;
+	return true;
 }
 
-template<typename T>
-typename AVL<T>::Node* AVL<T>::split(typename AVL<T>::Node* p, const T& k) {
-	auto [value, size, height, left, right] = *p; delete p;
-	if (value == k) {
-		root = left;
-		insert(k);
-		return right;
-	} else if (k < value) {
-		auto [_value, _size, _height, _left, _right] = *split(left, k);
-		root = _left;
-		insert(k);
-		return join(_right, value, right);
+template<typename T, typename Compare, size_t Slot>
+std::pair<typename AVL<T, Compare, Slot>::Node*,typename AVL<T, Compare, Slot>::Node*> AVL<T, Compare, Slot>::split(typename AVL<T, Compare, Slot>::Node* p, const T& k, bool after) {
+	if (p == nullptr) return {nullptr, nullptr};
+	typename AVL<T, Compare, Slot>::Node *left = p->left, *right = p->right;
+	p->left = p->right = nullptr;
+	// after: the key k stays on the left side, otherwise it goes to the right one
+	if (after ? cmp(k, p->value) : !cmp(p->value, k)) {
+		auto [_left, _right] = split(left, k, after);
+		return {_left, join(_right, p, right)};
 	} else {
-		auto [_value, _size, _height, _left, _right] = *split(right, k);
-		root = join(left, value, _left);
-		insert(k);
-		return _right;
+		auto [_left, _right] = split(right, k, after);
+		return {join(left, p, _left), _right};
 	}
 }
 
-template<typename T>
-std::pair<bool,typename AVL<T>::Node*> AVL<T>::split(const T& value) {
+template<typename T, typename Compare, size_t Slot>
+std::pair<bool,typename AVL<T, Compare, Slot>::Node*> AVL<T, Compare, Slot>::split(const T& value) {
 	if (!contains(value)) return {false, nullptr};
-	return {true, split(root, value)};
+	auto [left, right] = split(root, value, true);
+	root = left;
+	if (right != nullptr)
+		rightmost = nullptr;
+	return {true, right};
+}
+
+// Moves the values from value on, or after it if after is set, into other,
+// which loses what it held first
+template<typename T, typename Compare, size_t Slot>
+void AVL<T, Compare, Slot>::split(const T& value, AVL<T, Compare, Slot>& other, bool after) {
+	other.clear();
+	auto [left, right] = split(root, value, after);
+	root = left;
+	other.root = right;
+	other.leftmost = nullptr;
+	other.rightmost = (right != nullptr ? rightmost : nullptr);
+	if (left == nullptr)
+		leftmost = nullptr;
+	rightmost = nullptr;
+}
+
+// Calls f once for every element, from several threads and in no particular order.
+// Subtrees are handed to new threads in proportion to their size
+template<typename T, typename Compare, size_t Slot>
+template<typename F>
+void AVL<T, Compare, Slot>::parallel_for_each(F f, unsigned threads) {
+	__parallel_helper_methods::for_each_value(root, f, std::max(1u, threads));
+}
+
+// Folds map(value) of every element in order with combine, which must be associative
+template<typename T, typename Compare, size_t Slot>
+template<typename R, typename Map, typename Combine>
+R AVL<T, Compare, Slot>::parallel_reduce(R identity, Map map, Combine combine, unsigned threads) {
+	return __parallel_helper_methods::reduce_values(root, identity, map, combine, std::max(1u, threads));
+}
+
+// Returns a new tree with the values satisfying pred. The filtered subtrees
+// are put back together with join, so the result is balanced
+template<typename T, typename Compare, size_t Slot>
+template<typename Pred>
+AVL<T, Compare, Slot> AVL<T, Compare, Slot>::parallel_filter(Pred pred, unsigned threads) {
+	return AVL<T, Compare, Slot>(parallel_filter(root, pred, std::max(1u, threads)), multiset, cmp);
+}
+
+template<typename T, typename Compare, size_t Slot>
+template<typename Pred>
+typename AVL<T, Compare, Slot>::Node* AVL<T, Compare, Slot>::parallel_filter(typename AVL<T, Compare, Slot>::Node* p, Pred& pred, unsigned threads) {
+	if (p == nullptr) return nullptr;
+	if (p->size < __parallel_helper_methods::grain) threads = 1;
+	unsigned left_threads = __parallel_helper_methods::share(threads, __avl_helper_methods::get_size(p->left), p->size);
+	typename AVL<T, Compare, Slot>::Node *left, *right;
+	__parallel_helper_methods::fork(threads,
+		[&] { left = parallel_filter(p->left, pred, left_threads); },
+		[&] { right = parallel_filter(p->right, pred, __parallel_helper_methods::rest(threads, left_threads)); });
+	if (pred(p->value))
+		return join(left, new typename AVL<T, Compare, Slot>::Node(p->value, p->count), right);
+	if (left == nullptr)
+		return right;
+	typename AVL<T, Compare, Slot>::Node *k;
+	left = split_last(left, k);
+	return join(left, k, right);
+}
+
+// Detaches the values in [lo, hi] into a new tree with two splits and a join
+template<typename T, typename Compare, size_t Slot>
+AVL<T, Compare, Slot> AVL<T, Compare, Slot>::extract_range(const T& lo, const T& hi) {
+	AVL<T, Compare, Slot> middle(multiset, cmp), right(multiset, cmp);
+	split(lo, middle);
+	middle.split(hi, right, true);
+	join(right);
+	typename AVL<T, Compare, Slot>::Node *range = middle.root;
+	middle.root = nullptr;
+	return AVL<T, Compare, Slot>(range, multiset, cmp);
+}
+
+// Detaches the values in [lo, hi] like extract_range and returns how many
+// there were. The nodes are only deleted by reclaim or the destructor
+template<typename T, typename Compare, size_t Slot>
+unsigned AVL<T, Compare, Slot>::erase_range(const T& lo, const T& hi) {
+	AVL<T, Compare, Slot> range = extract_range(lo, hi);
+	unsigned removed = range.size();
+	graveyard.push(range.root);
+	range.root = nullptr;
+	return removed;
+}
+
+// Deletes up to budget nodes detached by erase_range, returns how many were deleted
+template<typename T, typename Compare, size_t Slot>
+size_t AVL<T, Compare, Slot>::reclaim(size_t budget) {
+	return graveyard.reclaim(budget);
+}
+
+// Whether the tree is in key order with exact sizes and heights, every node
+// is balanced and the cached ends, where known, are its first and last nodes
+template<typename T, typename Compare, size_t Slot>
+bool AVL<T, Compare, Slot>::verify() {
+	typename AVL<T, Compare, Slot>::Node *first = root, *last = root;
+	while (first != nullptr && first->left != nullptr)
+		first = first->left;
+	while (last != nullptr && last->right != nullptr)
+		last = last->right;
+	if ((leftmost != nullptr && leftmost != first) || (rightmost != nullptr && rightmost != last))
+		return false;
+	return verify(root, nullptr, nullptr) >= 0;
+}
+
+// The height of p's subtree, or -1 if it breaks an invariant
+template<typename T, typename Compare, size_t Slot>
+int AVL<T, Compare, Slot>::verify(typename AVL<T, Compare, Slot>::Node* p, const T* lo, const T* hi) {
+	if (p == nullptr)
+		return 0;
+	if (p->count == 0 || (!multiset && p->count > 1))
+		return -1;
+	if ((lo != nullptr && !cmp(*lo, p->value)) || (hi != nullptr && !cmp(p->value, *hi)))
+		return -1;
+	int hl = verify(p->left, lo, &p->value);
+	int hr = verify(p->right, &p->value, hi);
+	if (hl < 0 || hr < 0 || hl - hr > 1 || hr - hl > 1 || (int) p->height != 1 + std::max(hl, hr))
+		return -1;
+	if ((int) p->size != (int) p->count + __avl_helper_methods::get_size(p->left) + __avl_helper_methods::get_size(p->right))
+		return -1;
+	return p->height;
 }
 
-template<typename T>
-void AVL<T>:: print(const std::string& prefix, typename AVL<T>::Node* p, bool isLeft) {
+template<typename T, typename Compare, size_t Slot>
+void AVL<T, Compare, Slot>:: print(const std::string& prefix, typename AVL<T, Compare, Slot>::Node* p, bool isLeft) {
 	if(p != nullptr) {
         std::cout << prefix;
         std::cout << (isLeft ? "├──" : "└──" );
@@ -385,8 +866,8 @@ void AVL<T>:: print(const std::string& prefix, typename AVL<T>::Node* p, bool is
     }
 }
 
-template<typename T>
-void AVL<T>::print() {
+template<typename T, typename Compare, size_t Slot>
+void AVL<T, Compare, Slot>::print() {
 	print("", root, false);
 }
 
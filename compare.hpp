@@ -0,0 +1,126 @@
+#ifndef COMPARE_HPP
+#define COMPARE_HPP
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+// Three-way comparison through the trees' Compare parameter, so a descent
+// settles each node with a single comparison:
+//   Compare::compare(a, b) is used when the comparator provides it,
+//   std::less on std::string and string_view keys compares them once through
+//   string_view, other types that merely convert to it (const char*) are
+//   left to the comparator so the whole tree keeps one order,
+//   anything else falls back to two calls of the comparator.
+// std::less<> makes the lookups heterogeneous, e.g. string_view probes into
+// a tree of std::string without building temporaries.
+//
+// The trees also cache their ends in leftmost and rightmost. A cached end is
+// either exact or null, and null is looked up again by min_node or max_node
+// on the next use. Split and join hand each side the end it shares with the
+// whole tree, so keeping the cache costs no extra comparison either.
+
+namespace __compare_helper_methods {
+	template<typename Compare, typename A, typename B, typename = void>
+	struct has_compare : std::false_type {};
+
+	template<typename Compare, typename A, typename B>
+	struct has_compare<Compare, A, B, std::void_t<decltype(std::declval<const Compare&>().compare(
+		std::declval<const A&>(), std::declval<const B&>()))>> : std::true_type {};
+
+	template<typename Compare>
+	struct is_std_less : std::false_type {};
+
+	template<typename T>
+	struct is_std_less<std::less<T>> : std::true_type {};
+
+	template<typename T>
+	struct is_string : std::false_type {};
+
+	template<typename Alloc>
+	struct is_string<std::basic_string<char, std::char_traits<char>, Alloc>> : std::true_type {};
+
+	template<>
+	struct is_string<std::string_view> : std::true_type {};
+
+	template<typename Compare, typename A, typename B>
+	int compare(const Compare& cmp, const A& a, const B& b);
+}
+
+// String key that keeps its first 8 bytes inline, so that comparing two keys
+// with different prefixes does not touch the heap buffers. Pair it with
+// PrefixedCompare, which also accepts string_view probes
+struct PrefixedString {
+	uint64_t prefix;
+	std::string str;
+	PrefixedString(std::string _str = std::string());
+	static uint64_t prefix_of(std::string_view s);
+};
+
+struct PrefixedCompare {
+	using is_transparent = void;
+	int compare(const PrefixedString& a, const PrefixedString& b) const;
+	int compare(const PrefixedString& a, std::string_view b) const;
+	int compare(std::string_view a, const PrefixedString& b) const;
+	template<typename A, typename B>
+	bool operator()(const A& a, const B& b) const;
+};
+
+template<>
+struct std::hash<PrefixedString> {
+	size_t operator()(const PrefixedString& key) const {
+		return std::hash<std::string>()(key.str);
+	}
+};
+
+///////// Implementation Starts Here
+
+template<typename Compare, typename A, typename B>
+int __compare_helper_methods::compare(const Compare& cmp, const A& a, const B& b) {
+	if constexpr (has_compare<Compare, A, B>::value) {
+		return cmp.compare(a, b);
+	} else if constexpr (is_std_less<Compare>::value
+	                     && is_string<A>::value && is_string<B>::value) {
+		return std::string_view(a).compare(std::string_view(b));
+	} else {
+		if (cmp(a, b)) return -1;
+		return (cmp(b, a) ? 1 : 0);
+	}
+}
+
+inline PrefixedString::PrefixedString(std::string _str) : prefix(prefix_of(_str)), str(std::move(_str)) {}
+
+// The first 8 bytes, big-endian and zero padded, so integer order agrees with string order
+inline uint64_t PrefixedString::prefix_of(std::string_view s) {
+	uint64_t prefix = 0;
+	for (size_t i = 0; i < 8; i++)
+		prefix = (prefix << 8) | (i < s.size() ? (unsigned char) s[i] : 0);
+	return prefix;
+}
+
+inline int PrefixedCompare::compare(const PrefixedString& a, const PrefixedString& b) const {
+	if (a.prefix != b.prefix)
+		return (a.prefix < b.prefix ? -1 : 1);
+	return a.str.compare(b.str);
+}
+
+inline int PrefixedCompare::compare(const PrefixedString& a, std::string_view b) const {
+	uint64_t b_prefix = PrefixedString::prefix_of(b);
+	if (a.prefix != b_prefix)
+		return (a.prefix < b_prefix ? -1 : 1);
+	return std::string_view(a.str).compare(b);
+}
+
+inline int PrefixedCompare::compare(std::string_view a, const PrefixedString& b) const {
+	return -compare(b, a);
+}
+
+template<typename A, typename B>
+bool PrefixedCompare::operator()(const A& a, const B& b) const {
+	return compare(a, b) < 0;
+}
+
+#endif
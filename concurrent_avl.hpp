@@ -0,0 +1,723 @@
+#ifndef CONCURRENT_AVL_HPP
+#define CONCURRENT_AVL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include "compare.hpp"
+#include "epoch.hpp"
+
+// AVL set for many threads at once, after Bronson, Casper, Chafi and Olukotun,
+// "A Practical Concurrent Binary Search Tree" (PPoPP 2010).
+//   Readers take no locks. Every node carries a version that a rotation bumps
+//   when the node shrinks (loses part of its key range) and that turns into
+//   unlinked when the node leaves the tree; a reader re-checks the version of
+//   the node it came from after each step and retries that step if it moved.
+//   Writers lock only the nodes they change, always parent before child.
+//   Erasing a node with two children leaves it in place as a routing node that
+//   is no longer present, it is unlinked once it has at most one child.
+//   Balance is relaxed: heights are repaired and rotations done bottom-up after
+//   each change, so the tree is a strict AVL tree whenever it is quiescent.
+// Unlinked nodes are freed through epochs, so a reader never touches freed
+// memory. Keys are unique and every atomic uses the default sequentially
+// consistent order, which costs readers nothing on x86.
+
+template<typename T, typename Compare = std::less<T>>
+class ConcurrentAVL {
+  public:
+	struct Node {
+		const T value;
+		std::atomic<bool> present;
+		std::atomic<int> height;
+		std::atomic<uint64_t> version;
+		std::atomic<Node*> parent, left, right;
+		std::mutex lock;
+		Node(const T& _value = T(), bool _present = true, Node* _parent = nullptr) : value(_value), present(_present),
+			height(1), version(0), parent(_parent), left(nullptr), right(nullptr) {}
+		Node* child(int dir);
+		void set_child(int dir, Node* x);
+	};
+
+	ConcurrentAVL(const Compare& _cmp = Compare());
+	ConcurrentAVL(const ConcurrentAVL<T, Compare>&) = delete;
+	~ConcurrentAVL();
+	ConcurrentAVL<T, Compare>& operator=(const ConcurrentAVL<T, Compare>&) = delete;
+	unsigned height();
+	unsigned size();
+	bool empty();
+	bool insert(const T& value);
+	bool erase(const T& value);
+	bool contains(const T& value);
+	// Lookups by any key the comparator can order against T, if it is transparent
+	template<typename K, typename C = Compare, typename = typename C::is_transparent>
+	bool contains(const K& key);
+	size_t reclaim();
+	bool verify();
+
+  private:
+	enum class Result { no, yes, retry };
+
+	// version bits: a rotation sets shrinking and adds shrink_count when done
+	static const uint64_t unlinked = 1;
+	static const uint64_t shrinking = 2;
+	static const uint64_t shrink_count = 4;
+
+	// node_condition answers these or the height the node should have
+	static const int nothing_required = -1;
+	static const int rebalance_required = -2;
+	static const int unlink_required = -3;
+
+	static void wait_until_not_changing(Node* node);
+	static bool can_unlink(Node* node);
+	template<typename K>
+	bool find(const K& key);
+	template<typename K>
+	Result attempt_get(const K& key, Node* node, int dir, uint64_t node_version);
+	Result attempt_insert(const T& value, Node* node, int dir, uint64_t node_version);
+	Result attempt_link(const T& value, Node* node, int dir, uint64_t node_version);
+	Result attempt_revive(Node* node);
+	Result attempt_erase(const T& value, Node* node, int dir, uint64_t node_version);
+	Result attempt_remove_node(Node* parent, Node* node);
+	bool attempt_unlink_nl(Node* parent, Node* node);
+	int node_condition(Node* node);
+	int verify(Node* node, Node* parent, const T* lo, const T* hi, long& present);
+	void fix_height_and_rebalance(Node* node);
+	Node* fix_height_nl(Node* node);
+	Node* rebalance_nl(Node* parent, Node* node);
+	Node* rebalance_to_right_nl(Node* parent, Node* node, Node* l, int hr0);
+	Node* rebalance_to_left_nl(Node* parent, Node* node, Node* r, int hl0);
+	Node* rotate_right_nl(Node* parent, Node* node, Node* l, int hr, int hll, Node* lr, int hlr);
+	Node* rotate_left_nl(Node* parent, Node* node, Node* r, int hl, int hrr, Node* rl, int hrl);
+	Node* rotate_right_over_left_nl(Node* parent, Node* node, Node* l, int hr, int hll, Node* lr, int hlrl);
+	Node* rotate_left_over_right_nl(Node* parent, Node* node, Node* r, int hl, int hrr, Node* rl, int hrlr);
+	Node *holder; // the root is its right child, it never changes version
+	Compare cmp;
+	std::atomic<long> count;
+	EpochReclaimer<Node> reclaimer;
+};
+
+namespace __concurrent_helper_methods {
+	template<typename Node>
+	int get_height(Node* node);
+}
+
+///////// Implementation Starts Here
+
+// NODE
+// ----
+
+// dir < 0 is the left child, anything else the right one
+template<typename T, typename Compare>
+typename ConcurrentAVL<T, Compare>::Node* ConcurrentAVL<T, Compare>::Node::child(int dir) {
+	return (dir < 0 ? left.load() : right.load());
+}
+
+template<typename T, typename Compare>
+void ConcurrentAVL<T, Compare>::Node::set_child(int dir, Node* x) {
+	if (dir < 0) left.store(x);
+	else right.store(x);
+}
+
+template<typename Node>
+int __concurrent_helper_methods::get_height(Node* node) {
+	return (node == nullptr ? 0 : node->height.load());
+}
+
+// CONCURRENT AVL
+// --------------
+
+template<typename T, typename Compare>
+ConcurrentAVL<T, Compare>::ConcurrentAVL(const Compare& _cmp) : holder(new Node(T(), false)), cmp(_cmp), count(0) {}
+
+// Nobody may be using the tree any more
+template<typename T, typename Compare>
+ConcurrentAVL<T, Compare>::~ConcurrentAVL() {
+	std::vector<Node*> stk{holder};
+	while (!stk.empty()) {
+		Node* node = stk.back();
+		stk.pop_back();
+		if (node->left.load() != nullptr) stk.push_back(node->left.load());
+		if (node->right.load() != nullptr) stk.push_back(node->right.load());
+		delete node;
+	}
+}
+
+template<typename T, typename Compare>
+unsigned ConcurrentAVL<T, Compare>::height() {
+	typename EpochReclaimer<Node>::Guard guard(reclaimer);
+	return __concurrent_helper_methods::get_height(holder->right.load());
+}
+
+// Exact whenever no write is in flight
+template<typename T, typename Compare>
+unsigned ConcurrentAVL<T, Compare>::size() {
+	return (unsigned) std::max(count.load(), 0L);
+}
+
+template<typename T, typename Compare>
+bool ConcurrentAVL<T, Compare>::empty() {
+	return size() == 0;
+}
+
+template<typename T, typename Compare>
+bool ConcurrentAVL<T, Compare>::insert(const T& value) {
+	typename EpochReclaimer<Node>::Guard guard(reclaimer);
+	if (attempt_insert(value, holder, 1, 0) == Result::no)
+		return false;
+	count++;
+	return true;
+}
+
+template<typename T, typename Compare>
+bool ConcurrentAVL<T, Compare>::erase(const T& value) {
+	typename EpochReclaimer<Node>::Guard guard(reclaimer);
+	if (attempt_erase(value, holder, 1, 0) == Result::no)
+		return false;
+	count--;
+	return true;
+}
+
+template<typename T, typename Compare>
+bool ConcurrentAVL<T, Compare>::contains(const T& value) {
+	return find(value);
+}
+
+template<typename T, typename Compare>
+template<typename K, typename C, typename>
+bool ConcurrentAVL<T, Compare>::contains(const K& key) {
+	return find(key);
+}
+
+// Frees what no thread can reach any more and returns how many nodes that was
+template<typename T, typename Compare>
+size_t ConcurrentAVL<T, Compare>::reclaim() {
+	return reclaimer.reclaim();
+}
+
+// Whether the tree is a strict AVL tree in key order with exact heights, its
+// parent links and size agree and routing nodes are left only where they
+// have two children. Only meaningful while no write is in flight
+template<typename T, typename Compare>
+bool ConcurrentAVL<T, Compare>::verify() {
+	typename EpochReclaimer<Node>::Guard guard(reclaimer);
+	long present = 0;
+	return verify(holder->right.load(), holder, nullptr, nullptr, present) >= 0 && present == count.load();
+}
+
+// The height of node's subtree, or -1 if it breaks an invariant
+template<typename T, typename Compare>
+int ConcurrentAVL<T, Compare>::verify(Node* node, Node* parent, const T* lo, const T* hi, long& present) {
+	if (node == nullptr)
+		return 0;
+	if (node->parent.load() != parent || (node->version.load() & (unlinked | shrinking)) != 0)
+		return -1;
+	if ((lo != nullptr && !cmp(*lo, node->value)) || (hi != nullptr && !cmp(node->value, *hi)))
+		return -1;
+	if (node->present.load())
+		present++;
+	else if (can_unlink(node))
+		return -1;
+	int hl = verify(node->left.load(), node, lo, &node->value, present);
+	int hr = verify(node->right.load(), node, &node->value, hi, present);
+	if (hl < 0 || hr < 0 || hl - hr > 1 || hr - hl > 1 || node->height.load() != 1 + std::max(hl, hr))
+		return -1;
+	return node->height.load();
+}
+
+// Rotations hold the node's lock while it is shrinking, so this waits for them
+template<typename T, typename Compare>
+void ConcurrentAVL<T, Compare>::wait_until_not_changing(Node* node) {
+	for (int spin = 0; spin < 100; spin++) {
+		if ((node->version.load() & shrinking) == 0)
+			return;
+	}
+	std::lock_guard<std::mutex> wait(node->lock);
+}
+
+template<typename T, typename Compare>
+bool ConcurrentAVL<T, Compare>::can_unlink(Node* node) {
+	return node->left.load() == nullptr || node->right.load() == nullptr;
+}
+
+// The holder never changes, so the walk from it never has to be retried
+template<typename T, typename Compare>
+template<typename K>
+bool ConcurrentAVL<T, Compare>::find(const K& key) {
+	typename EpochReclaimer<Node>::Guard guard(reclaimer);
+	return attempt_get(key, holder, 1, 0) == Result::yes;
+}
+
+// Looks for key below node's child in direction dir, while node still has node_version.
+// A child is only entered after node's version is confirmed again, so it was
+// node's child and covered key at that moment
+template<typename T, typename Compare>
+template<typename K>
+typename ConcurrentAVL<T, Compare>::Result ConcurrentAVL<T, Compare>::attempt_get(const K& key, Node* node, int dir, uint64_t node_version) {
+	while (true) {
+		Node* child = node->child(dir);
+		if (node->version.load() != node_version)
+			return Result::retry;
+		if (child == nullptr)
+			return Result::no;
+
+		int c = __compare_helper_methods::compare(cmp, key, child->value);
+		if (c == 0)
+			return (child->present.load() ? Result::yes : Result::no);
+
+		uint64_t child_version = child->version.load();
+		if (child_version & shrinking) {
+			wait_until_not_changing(child);
+		} else if (child_version != unlinked && child == node->child(dir)) {
+			if (node->version.load() != node_version)
+				return Result::retry;
+			Result result = attempt_get(key, child, c, child_version);
+			if (result != Result::retry)
+				return result;
+		}
+	}
+}
+
+// INSERTION
+// ---------
+
+// Same walk as attempt_get, ending in a link at an empty child or a revival of a routing node
+template<typename T, typename Compare>
+typename ConcurrentAVL<T, Compare>::Result ConcurrentAVL<T, Compare>::attempt_insert(const T& value, Node* node, int dir, uint64_t node_version) {
+	Result result = Result::retry;
+	do {
+		Node* child = node->child(dir);
+		if (node->version.load() != node_version)
+			return Result::retry;
+
+		if (child == nullptr) {
+			result = attempt_link(value, node, dir, node_version);
+			continue;
+		}
+		int c = __compare_helper_methods::compare(cmp, value, child->value);
+		if (c == 0) {
+			result = attempt_revive(child);
+			continue;
+		}
+		uint64_t child_version = child->version.load();
+		if (child_version & shrinking) {
+			wait_until_not_changing(child);
+		} else if (child_version != unlinked && child == node->child(dir)) {
+			if (node->version.load() != node_version)
+				return Result::retry;
+			result = attempt_insert(value, child, c, child_version);
+		}
+	} while (result == Result::retry);
+	return result;
+}
+
+template<typename T, typename Compare>
+typename ConcurrentAVL<T, Compare>::Result ConcurrentAVL<T, Compare>::attempt_link(const T& value, Node* node, int dir, uint64_t node_version) {
+	{
+		std::lock_guard<std::mutex> hold(node->lock);
+		if (node->version.load() != node_version || node->child(dir) != nullptr)
+			return Result::retry;
+		node->set_child(dir, new Node(value, true, node));
+	}
+	fix_height_and_rebalance(node);
+	return Result::yes;
+}
+
+template<typename T, typename Compare>
+typename ConcurrentAVL<T, Compare>::Result ConcurrentAVL<T, Compare>::attempt_revive(Node* node) {
+	std::lock_guard<std::mutex> hold(node->lock);
+	if (node->version.load() == unlinked)
+		return Result::retry;
+	if (node->present.load())
+		return Result::no;
+	node->present.store(true);
+	return Result::yes;
+}
+
+// ERASE
+// -----
+
+template<typename T, typename Compare>
+typename ConcurrentAVL<T, Compare>::Result ConcurrentAVL<T, Compare>::attempt_erase(const T& value, Node* node, int dir, uint64_t node_version) {
+	Result result = Result::retry;
+	do {
+		Node* child = node->child(dir);
+		if (node->version.load() != node_version)
+			return Result::retry;
+		if (child == nullptr)
+			return Result::no;
+
+		int c = __compare_helper_methods::compare(cmp, value, child->value);
+		if (c == 0) {
+			result = attempt_remove_node(node, child);
+			continue;
+		}
+		uint64_t child_version = child->version.load();
+		if (child_version & shrinking) {
+			wait_until_not_changing(child);
+		} else if (child_version != unlinked && child == node->child(dir)) {
+			if (node->version.load() != node_version)
+				return Result::retry;
+			result = attempt_erase(value, child, c, child_version);
+		}
+	} while (result == Result::retry);
+	return result;
+}
+
+// A node with two children only stops being present, otherwise it leaves the tree
+template<typename T, typename Compare>
+typename ConcurrentAVL<T, Compare>::Result ConcurrentAVL<T, Compare>::attempt_remove_node(Node* parent, Node* node) {
+	if (!node->present.load())
+		return Result::no;
+
+	if (!can_unlink(node)) {
+		std::lock_guard<std::mutex> hold(node->lock);
+		if (node->version.load() == unlinked || can_unlink(node))
+			return Result::retry;
+		if (!node->present.load())
+			return Result::no;
+		node->present.store(false);
+		return Result::yes;
+	}
+
+	bool was_present;
+	{
+		std::lock_guard<std::mutex> hold_parent(parent->lock);
+		if (parent->version.load() == unlinked || node->parent.load() != parent || node->version.load() == unlinked)
+			return Result::retry;
+		std::lock_guard<std::mutex> hold(node->lock);
+		if (!can_unlink(node))
+			return Result::retry;
+		was_present = node->present.load();
+		node->present.store(false);
+		Node* splice = (node->left.load() != nullptr ? node->left.load() : node->right.load());
+		if (parent->left.load() == node) parent->left.store(splice);
+		else parent->right.store(splice);
+		if (splice != nullptr) splice->parent.store(parent);
+		node->version.store(unlinked);
+	}
+	reclaimer.retire(node);
+	fix_height_and_rebalance(parent);
+	return (was_present ? Result::yes : Result::no);
+}
+
+// parent and node are locked, node is a routing node
+template<typename T, typename Compare>
+bool ConcurrentAVL<T, Compare>::attempt_unlink_nl(Node* parent, Node* node) {
+	Node *parent_l = parent->left.load(), *parent_r = parent->right.load();
+	if (parent_l != node && parent_r != node)
+		return false;
+	Node *l = node->left.load(), *r = node->right.load();
+	if (l != nullptr && r != nullptr)
+		return false;
+
+	Node* splice = (l != nullptr ? l : r);
+	if (parent_l == node) parent->left.store(splice);
+	else parent->right.store(splice);
+	if (splice != nullptr) splice->parent.store(parent);
+	node->version.store(unlinked);
+	reclaimer.retire(node);
+	return true;
+}
+
+// REBALANCING
+// -----------
+// The _nl methods expect their caller to hold the locks of the nodes they are
+// given and take those of the nodes further down themselves. They return the
+// next node that needs repair, or nullptr when the tree is fine again.
+
+template<typename T, typename Compare>
+int ConcurrentAVL<T, Compare>::node_condition(Node* node) {
+	Node *l = node->left.load(), *r = node->right.load();
+	if ((l == nullptr || r == nullptr) && !node->present.load())
+		return unlink_required;
+
+	int h = node->height.load();
+	int hl = __concurrent_helper_methods::get_height(l), hr = __concurrent_helper_methods::get_height(r);
+	int h_repl = 1 + std::max(hl, hr);
+	int balance = hl - hr;
+	if (balance < -1 || balance > 1)
+		return rebalance_required;
+	return (h != h_repl ? h_repl : nothing_required);
+}
+
+// Walks up from node for as long as something needs repair. A rotation that
+// leaves damage below it hands back the lower node, and the walk from there
+// may end before it is back above the rotation, so the nodes the rotation
+// touched are checked again afterwards
+template<typename T, typename Compare>
+void ConcurrentAVL<T, Compare>::fix_height_and_rebalance(Node* node) {
+	std::vector<Node*> skipped;
+	while (true) {
+		if (node == nullptr || node->parent.load() == nullptr || node->version.load() == unlinked) {
+			if (skipped.empty())
+				return;
+			node = skipped.back();
+			skipped.pop_back();
+			continue;
+		}
+
+		int condition = node_condition(node);
+		if (condition == nothing_required) {
+			node = nullptr;
+		} else if (condition != unlink_required && condition != rebalance_required) {
+			std::lock_guard<std::mutex> hold(node->lock);
+			node = fix_height_nl(node);
+		} else {
+			Node* parent = node->parent.load();
+			std::lock_guard<std::mutex> hold_parent(parent->lock);
+			if (parent->version.load() != unlinked && node->parent.load() == parent) {
+				bool on_left = (parent->left.load() == node);
+				Node* next;
+				{
+					std::lock_guard<std::mutex> hold(node->lock);
+					next = rebalance_nl(parent, node);
+				}
+				if (next != nullptr && next != parent && next != parent->parent.load()) {
+					Node* top = (on_left ? parent->left.load() : parent->right.load());
+					for (Node* touched : {parent, top, node}) {
+						if (touched != nullptr && touched != next
+						    && std::find(skipped.begin(), skipped.end(), touched) == skipped.end())
+							skipped.push_back(touched);
+					}
+				}
+				node = next;
+			}
+		}
+	}
+}
+
+template<typename T, typename Compare>
+typename ConcurrentAVL<T, Compare>::Node* ConcurrentAVL<T, Compare>::fix_height_nl(Node* node) {
+	int condition = node_condition(node);
+	switch (condition) {
+		case rebalance_required:
+		case unlink_required:
+			return node;
+		case nothing_required:
+			return nullptr;
+		default:
+			node->height.store(condition);
+			return node->parent.load();
+	}
+}
+
+template<typename T, typename Compare>
+typename ConcurrentAVL<T, Compare>::Node* ConcurrentAVL<T, Compare>::rebalance_nl(Node* parent, Node* node) {
+	Node *l = node->left.load(), *r = node->right.load();
+	if ((l == nullptr || r == nullptr) && !node->present.load())
+		return (attempt_unlink_nl(parent, node) ? fix_height_nl(parent) : node);
+
+	int h = node->height.load();
+	int hl = __concurrent_helper_methods::get_height(l), hr = __concurrent_helper_methods::get_height(r);
+	int h_repl = 1 + std::max(hl, hr);
+	int balance = hl - hr;
+	if (balance > 1)
+		return rebalance_to_right_nl(parent, node, l, hr);
+	if (balance < -1)
+		return rebalance_to_left_nl(parent, node, r, hl);
+	if (h_repl != h) {
+		node->height.store(h_repl);
+		return fix_height_nl(parent);
+	}
+	return nullptr;
+}
+
+// A double rotation may leave damage at the left child, which it reports
+template<typename T, typename Compare>
+typename ConcurrentAVL<T, Compare>::Node* ConcurrentAVL<T, Compare>::rebalance_to_right_nl(Node* parent, Node* node, Node* l, int hr0) {
+	std::lock_guard<std::mutex> hold_l(l->lock);
+	int hl = l->height.load();
+	if (hl - hr0 <= 1)
+		return node;
+
+	Node* lr = l->right.load();
+	int hll0 = __concurrent_helper_methods::get_height(l->left.load());
+	int hlr0 = __concurrent_helper_methods::get_height(lr);
+	if (hll0 >= hlr0)
+		return rotate_right_nl(parent, node, l, hr0, hll0, lr, hlr0);
+	std::lock_guard<std::mutex> hold_lr(lr->lock);
+	int hlr = lr->height.load();
+	if (hll0 >= hlr)
+		return rotate_right_nl(parent, node, l, hr0, hll0, lr, hlr);
+	return rotate_right_over_left_nl(parent, node, l, hr0, hll0, lr, __concurrent_helper_methods::get_height(lr->left.load()));
+}
+
+template<typename T, typename Compare>
+typename ConcurrentAVL<T, Compare>::Node* ConcurrentAVL<T, Compare>::rebalance_to_left_nl(Node* parent, Node* node, Node* r, int hl0) {
+	std::lock_guard<std::mutex> hold_r(r->lock);
+	int hr = r->height.load();
+	if (hl0 - hr >= -1)
+		return node;
+
+	Node* rl = r->left.load();
+	int hrl0 = __concurrent_helper_methods::get_height(rl);
+	int hrr0 = __concurrent_helper_methods::get_height(r->right.load());
+	if (hrr0 >= hrl0)
+		return rotate_left_nl(parent, node, r, hl0, hrr0, rl, hrl0);
+	std::lock_guard<std::mutex> hold_rl(rl->lock);
+	int hrl = rl->height.load();
+	if (hrr0 >= hrl)
+		return rotate_left_nl(parent, node, r, hl0, hrr0, rl, hrl);
+	return rotate_left_over_right_nl(parent, node, r, hl0, hrr0, rl, __concurrent_helper_methods::get_height(rl->right.load()));
+}
+
+// node moves down and loses the keys of l's left subtree, so it is marked shrinking meanwhile
+template<typename T, typename Compare>
+typename ConcurrentAVL<T, Compare>::Node* ConcurrentAVL<T, Compare>::rotate_right_nl(Node* parent, Node* node, Node* l, int hr, int hll, Node* lr, int hlr) {
+	uint64_t node_version = node->version.load();
+	Node* parent_l = parent->left.load();
+	node->version.store(node_version | shrinking);
+
+	node->left.store(lr);
+	if (lr != nullptr) lr->parent.store(node);
+	l->right.store(node);
+	node->parent.store(l);
+	if (parent_l == node) parent->left.store(l);
+	else parent->right.store(l);
+	l->parent.store(parent);
+
+	int h_node = 1 + std::max(hlr, hr);
+	node->height.store(h_node);
+	l->height.store(1 + std::max(hll, h_node));
+	node->version.store(node_version + shrink_count);
+
+	int balance_node = hlr - hr;
+	if (balance_node < -1 || balance_node > 1)
+		return node;
+	if ((lr == nullptr || hr == 0) && !node->present.load())
+		return node;
+	int balance_l = hll - h_node;
+	if (balance_l < -1 || balance_l > 1)
+		return l;
+	if (hll == 0 && !l->present.load())
+		return l;
+	return fix_height_nl(parent);
+}
+
+template<typename T, typename Compare>
+typename ConcurrentAVL<T, Compare>::Node* ConcurrentAVL<T, Compare>::rotate_left_nl(Node* parent, Node* node, Node* r, int hl, int hrr, Node* rl, int hrl) {
+	uint64_t node_version = node->version.load();
+	Node* parent_l = parent->left.load();
+	node->version.store(node_version | shrinking);
+
+	node->right.store(rl);
+	if (rl != nullptr) rl->parent.store(node);
+	r->left.store(node);
+	node->parent.store(r);
+	if (parent_l == node) parent->left.store(r);
+	else parent->right.store(r);
+	r->parent.store(parent);
+
+	int h_node = 1 + std::max(hl, hrl);
+	node->height.store(h_node);
+	r->height.store(1 + std::max(h_node, hrr));
+	node->version.store(node_version + shrink_count);
+
+	int balance_node = hrl - hl;
+	if (balance_node < -1 || balance_node > 1)
+		return node;
+	if ((rl == nullptr || hl == 0) && !node->present.load())
+		return node;
+	int balance_r = hrr - h_node;
+	if (balance_r < -1 || balance_r > 1)
+		return r;
+	if (hrr == 0 && !r->present.load())
+		return r;
+	return fix_height_nl(parent);
+}
+
+// lr comes up between l and node, both of which shrink
+template<typename T, typename Compare>
+typename ConcurrentAVL<T, Compare>::Node* ConcurrentAVL<T, Compare>::rotate_right_over_left_nl(Node* parent, Node* node, Node* l, int hr, int hll, Node* lr, int hlrl) {
+	uint64_t node_version = node->version.load(), l_version = l->version.load();
+	Node* parent_l = parent->left.load();
+	Node *lrl = lr->left.load(), *lrr = lr->right.load();
+	int hlrr = __concurrent_helper_methods::get_height(lrr);
+	node->version.store(node_version | shrinking);
+	l->version.store(l_version | shrinking);
+
+	node->left.store(lrr);
+	if (lrr != nullptr) lrr->parent.store(node);
+	l->right.store(lrl);
+	if (lrl != nullptr) lrl->parent.store(l);
+	lr->left.store(l);
+	l->parent.store(lr);
+	lr->right.store(node);
+	node->parent.store(lr);
+	if (parent_l == node) parent->left.store(lr);
+	else parent->right.store(lr);
+	lr->parent.store(parent);
+
+	int h_node = 1 + std::max(hlrr, hr);
+	node->height.store(h_node);
+	int h_l = 1 + std::max(hll, hlrl);
+	l->height.store(h_l);
+	lr->height.store(1 + std::max(h_l, h_node));
+	node->version.store(node_version + shrink_count);
+	l->version.store(l_version + shrink_count);
+
+	int balance_node = hlrr - hr;
+	if (balance_node < -1 || balance_node > 1)
+		return node;
+	if ((lrr == nullptr || hr == 0) && !node->present.load())
+		return node;
+	int balance_l = hll - hlrl;
+	if (balance_l < -1 || balance_l > 1)
+		return l;
+	if ((hll == 0 || hlrl == 0) && !l->present.load())
+		return l;
+	int balance_lr = h_l - h_node;
+	if (balance_lr < -1 || balance_lr > 1)
+		return lr;
+	return fix_height_nl(parent);
+}
+
+template<typename T, typename Compare>
+typename ConcurrentAVL<T, Compare>::Node* ConcurrentAVL<T, Compare>::rotate_left_over_right_nl(Node* parent, Node* node, Node* r, int hl, int hrr, Node* rl, int hrlr) {
+	uint64_t node_version = node->version.load(), r_version = r->version.load();
+	Node* parent_l = parent->left.load();
+	Node *rll = rl->left.load(), *rlr = rl->right.load();
+	int hrll = __concurrent_helper_methods::get_height(rll);
+	node->version.store(node_version | shrinking);
+	r->version.store(r_version | shrinking);
+
+	node->right.store(rll);
+	if (rll != nullptr) rll->parent.store(node);
+	r->left.store(rlr);
+	if (rlr != nullptr) rlr->parent.store(r);
+	rl->right.store(r);
+	r->parent.store(rl);
+	rl->left.store(node);
+	node->parent.store(rl);
+	if (parent_l == node) parent->left.store(rl);
+	else parent->right.store(rl);
+	rl->parent.store(parent);
+
+	int h_node = 1 + std::max(hl, hrll);
+	node->height.store(h_node);
+	int h_r = 1 + std::max(hrlr, hrr);
+	r->height.store(h_r);
+	rl->height.store(1 + std::max(h_node, h_r));
+	node->version.store(node_version + shrink_count);
+	r->version.store(r_version + shrink_count);
+
+	int balance_node = hrll - hl;
+	if (balance_node < -1 || balance_node > 1)
+		return node;
+	if ((rll == nullptr || hl == 0) && !node->present.load())
+		return node;
+	int balance_r = hrr - hrlr;
+	if (balance_r < -1 || balance_r > 1)
+		return r;
+	if ((hrr == 0 || hrlr == 0) && !r->present.load())
+		return r;
+	int balance_rl = h_r - h_node;
+	if (balance_rl < -1 || balance_rl > 1)
+		return rl;
+	return fix_height_nl(parent);
+}
+
+#endif
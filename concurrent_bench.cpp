@@ -0,0 +1,82 @@
+#include "concurrent_avl.hpp"
+#include "avl.hpp"
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// Lookup throughput as reader threads are added while one writer keeps
+// inserting and erasing, for ConcurrentAVL and for an AVL behind a shared_mutex
+//   ./concurrent_bench <seed> [keys] [milliseconds]
+// Build without the sanitizers for meaningful numbers, e.g.
+//   make concurrent_bench CXXFLAGS="-O2 -std=c++17 -pthread"
+
+// The even keys below 2 * keys are always there, the writer toggles the odd ones
+template<typename Contains, typename Insert, typename Erase>
+double run(unsigned readers, int n, int ms, unsigned seed, Contains contains, Insert insert, Erase erase) {
+	atomic<bool> stop{false};
+	atomic<long> lookups{0};
+	vector<thread> threads;
+	for (unsigned r = 0; r < readers; r++) {
+		threads.emplace_back([&, r] {
+			mt19937 gen(seed + r);
+			long done = 0, found = 0;
+			while (!stop.load(memory_order_relaxed)) {
+				found += contains((int) (gen() % (2 * n)));
+				done++;
+			}
+			lookups += done + (found < 0);
+		});
+	}
+	threads.emplace_back([&] {
+		mt19937 gen(seed - 1);
+		while (!stop.load(memory_order_relaxed)) {
+			int key = 2 * (int) (gen() % n) + 1;
+			if (gen() % 2) insert(key);
+			else erase(key);
+		}
+	});
+
+	this_thread::sleep_for(chrono::milliseconds(ms));
+	stop = true;
+	for (thread& t : threads)
+		t.join();
+	return lookups / (ms * 1000.0);
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		cerr << "usage: " << argv[0] << " <seed> [keys] [milliseconds]" << endl;
+		return 1;
+	}
+	unsigned seed = atoi(argv[1]);
+	int n = (argc > 2 ? atoi(argv[2]) : 100000);
+	int ms = (argc > 3 ? atoi(argv[3]) : 500);
+	unsigned max_readers = max(1u, thread::hardware_concurrency() - 1);
+
+	cout << "readers\tconcurrent\tshared_mutex\t(million lookups/s)" << endl;
+	for (unsigned readers = 1; readers <= max_readers; readers *= 2) {
+		ConcurrentAVL<int> C;
+		for (int i = 0; i < n; i++)
+			C.insert(2 * i);
+		double concurrent = run(readers, n, ms, seed,
+			[&](int key) { return C.contains(key); },
+			[&](int key) { C.insert(key); },
+			[&](int key) { C.erase(key); });
+
+		AVL<int> T;
+		shared_mutex lock;
+		for (int i = 0; i < n; i++)
+			T.insert(2 * i);
+		double locked = run(readers, n, ms, seed,
+			[&](int key) { shared_lock<shared_mutex> hold(lock); return T.contains(key); },
+			[&](int key) { unique_lock<shared_mutex> hold(lock); T.insert(key); },
+			[&](int key) { unique_lock<shared_mutex> hold(lock); T.erase(key); });
+
+		cout << readers << "\t" << concurrent << "\t" << locked << endl;
+	}
+}
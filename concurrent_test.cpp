@@ -0,0 +1,79 @@
+#include "concurrent_avl.hpp"
+#include <iostream>
+#include <atomic>
+#include <cassert>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// Differential check of ConcurrentAVL against one std::set per writer
+//   ./concurrent_test <seed> [writers] [readers] [ops]
+// Writer w owns the keys that are w modulo the number of writers, so the
+// result of each of its inserts, erases and lookups is known from its own set
+// while the others keep changing the tree around them. Readers look up keys
+// that are always there and random ones. Once every thread is done the tree
+// must hold exactly the union of the sets and be a strict AVL tree again.
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		cerr << "usage: " << argv[0] << " <seed> [writers] [readers] [ops]" << endl;
+		return 1;
+	}
+	unsigned seed = atoi(argv[1]);
+	int writers = (argc > 2 ? atoi(argv[2]) : 4);
+	int readers = (argc > 3 ? atoi(argv[3]) : 4);
+	int ops = (argc > 4 ? atoi(argv[4]) : 100000);
+	int keys = 2000; // per writer, small enough for the writers to collide often
+
+	ConcurrentAVL<int> T;
+	int stable = 1000; // the negative keys -1 .. -stable are never erased
+	for (int i = 1; i <= stable; i++)
+		T.insert(-i);
+
+	vector<set<int>> S(writers);
+	atomic<bool> stop{false};
+	vector<thread> threads;
+	for (int w = 0; w < writers; w++) {
+		threads.emplace_back([&, w] {
+			mt19937 gen(seed + w);
+			for (int i = 0; i < ops; i++) {
+				int value = (int) (gen() % keys) * writers + w;
+				int coin = gen() % 3;
+				if (coin == 0)
+					assert(T.insert(value) == S[w].insert(value).second);
+				else if (coin == 1)
+					assert(T.erase(value) == (S[w].erase(value) == 1));
+				else
+					assert(T.contains(value) == (S[w].count(value) == 1));
+				if (i % 1024 == 0)
+					T.reclaim();
+			}
+		});
+	}
+	for (int r = 0; r < readers; r++) {
+		threads.emplace_back([&, r] {
+			mt19937 gen(seed - 1 - r);
+			while (!stop.load()) {
+				assert(T.contains(-1 - (int) (gen() % stable)));
+				T.contains((int) (gen() % (keys * writers)));
+			}
+		});
+	}
+
+	for (int w = 0; w < writers; w++)
+		threads[w].join();
+	stop = true;
+	for (size_t i = writers; i < threads.size(); i++)
+		threads[i].join();
+
+	size_t expected = stable;
+	for (const set<int>& s : S)
+		expected += s.size();
+	assert(T.size() == expected);
+	for (int value = 0; value < keys * writers; value++)
+		assert(T.contains(value) == (S[value % writers].count(value) == 1));
+	assert(T.verify());
+	cout << "size " << T.size() << ", height " << T.height() << ", reclaimed " << T.reclaim() << endl;
+}
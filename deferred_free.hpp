@@ -0,0 +1,82 @@
+#ifndef DEFERRED_FREE_HPP
+#define DEFERRED_FREE_HPP
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Holds detached subtrees so their nodes can be deleted later, a bounded
+// batch at a time, instead of inside the operation that detached them.
+// Whatever is still pending is deleted by the destructor
+template<typename Node>
+class DeferredFree {
+  public:
+	DeferredFree();
+	DeferredFree(const DeferredFree<Node>&) = delete;
+	DeferredFree(DeferredFree<Node>&& other);
+	~DeferredFree();
+	DeferredFree<Node>& operator=(const DeferredFree<Node>&) = delete;
+	DeferredFree<Node>& operator=(DeferredFree<Node>&& other);
+	void swap(DeferredFree<Node>& other);
+	void push(Node* subtree);
+	size_t reclaim(size_t budget);
+	bool empty();
+
+  private:
+	std::vector<Node*> pending;
+};
+
+///////// Implementation Starts Here
+
+template<typename Node>
+DeferredFree<Node>::DeferredFree() {}
+
+template<typename Node>
+DeferredFree<Node>::DeferredFree(DeferredFree<Node>&& other) : pending(std::move(other.pending)) {
+	other.pending.clear();
+}
+
+template<typename Node>
+DeferredFree<Node>::~DeferredFree() {
+	reclaim((size_t) -1);
+}
+
+// The pending nodes of both are kept, the other side frees them on its own
+template<typename Node>
+DeferredFree<Node>& DeferredFree<Node>::operator=(DeferredFree<Node>&& other) {
+	swap(other);
+	return *this;
+}
+
+template<typename Node>
+void DeferredFree<Node>::swap(DeferredFree<Node>& other) {
+	pending.swap(other.pending);
+}
+
+template<typename Node>
+void DeferredFree<Node>::push(Node* subtree) {
+	if (subtree != nullptr)
+		pending.push_back(subtree);
+}
+
+// Deletes up to budget nodes and returns how many were deleted
+template<typename Node>
+size_t DeferredFree<Node>::reclaim(size_t budget) {
+	size_t freed = 0;
+	while (freed < budget && !pending.empty()) {
+		Node* at = pending.back();
+		pending.pop_back();
+		if (at->left != nullptr) pending.push_back(at->left);
+		if (at->right != nullptr) pending.push_back(at->right);
+		delete at;
+		freed++;
+	}
+	return freed;
+}
+
+template<typename Node>
+bool DeferredFree<Node>::empty() {
+	return pending.empty();
+}
+
+#endif
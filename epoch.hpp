@@ -0,0 +1,171 @@
+#ifndef EPOCH_HPP
+#define EPOCH_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Epoch based reclamation for structures that are read without locks.
+// A thread publishes the global epoch in its own slot while it is inside an
+// operation. An unlinked node is retired with the epoch of the moment and
+// deleted once the global epoch is two steps past it, by then no thread that
+// could have reached the node is still inside. The epoch only advances when
+// every thread inside has caught up with it.
+
+namespace __epoch_helper_methods {
+	const unsigned max_threads = 128;
+
+	unsigned thread_index();
+}
+
+template<typename Node>
+class EpochReclaimer {
+  public:
+	// Keeps the calling thread inside for its lifetime, nested guards are free
+	class Guard {
+	  public:
+		Guard(EpochReclaimer<Node>& _owner);
+		Guard(const Guard&) = delete;
+		~Guard();
+		Guard& operator=(const Guard&) = delete;
+
+	  private:
+		EpochReclaimer<Node>& owner;
+		unsigned index;
+		bool outer;
+	};
+
+	EpochReclaimer();
+	EpochReclaimer(const EpochReclaimer<Node>&) = delete;
+	~EpochReclaimer();
+	EpochReclaimer<Node>& operator=(const EpochReclaimer<Node>&) = delete;
+	void retire(Node* node);
+	size_t reclaim();
+	size_t pending();
+
+	// Retirements between two attempts to advance the epoch
+	static const unsigned batch = 64;
+
+  private:
+	// 0 while the thread is outside, 2 * epoch + 1 while it is inside
+	struct alignas(64) Slot {
+		std::atomic<uint64_t> state{0};
+	};
+
+	std::atomic<uint64_t> epoch;
+	Slot slots[__epoch_helper_methods::max_threads];
+	std::mutex retired_lock;
+	std::vector<std::pair<uint64_t, Node*>> retired; // in order of epoch
+	bool try_advance();
+	size_t reclaim_locked();
+};
+
+///////// Implementation Starts Here
+
+// Every thread gets the smallest free index and gives it back when it exits
+inline unsigned __epoch_helper_methods::thread_index() {
+	struct Registry {
+		std::mutex lock;
+		std::vector<unsigned> free;
+		unsigned next = 0;
+	};
+	static Registry registry;
+
+	struct Holder {
+		unsigned index;
+		Holder() {
+			std::lock_guard<std::mutex> hold(registry.lock);
+			if (!registry.free.empty()) {
+				index = registry.free.back();
+				registry.free.pop_back();
+			} else if (registry.next < max_threads) {
+				index = registry.next++;
+			} else {
+				throw std::runtime_error("Too many threads!");
+			}
+		}
+		~Holder() {
+			std::lock_guard<std::mutex> hold(registry.lock);
+			registry.free.push_back(index);
+		}
+	};
+	thread_local Holder holder;
+	return holder.index;
+}
+
+// The fence keeps the reads of the operation from moving above the publication
+template<typename Node>
+EpochReclaimer<Node>::Guard::Guard(EpochReclaimer<Node>& _owner) : owner(_owner), index(__epoch_helper_methods::thread_index()) {
+	std::atomic<uint64_t>& state = owner.slots[index].state;
+	outer = (state.load(std::memory_order_relaxed) == 0);
+	if (outer) {
+		state.store(2 * owner.epoch.load() + 1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+}
+
+template<typename Node>
+EpochReclaimer<Node>::Guard::~Guard() {
+	if (outer)
+		owner.slots[index].state.store(0, std::memory_order_release);
+}
+
+template<typename Node>
+EpochReclaimer<Node>::EpochReclaimer() : epoch(1) {}
+
+// Nobody may be inside any more
+template<typename Node>
+EpochReclaimer<Node>::~EpochReclaimer() {
+	for (auto& [retired_at, node] : retired)
+		delete node;
+}
+
+// node must already be unreachable for threads that enter from now on
+template<typename Node>
+void EpochReclaimer<Node>::retire(Node* node) {
+	std::lock_guard<std::mutex> hold(retired_lock);
+	retired.emplace_back(epoch.load(), node);
+	if (retired.size() % batch == 0)
+		reclaim_locked();
+}
+
+// Deletes the retired nodes that are safe by now and returns how many there were
+template<typename Node>
+size_t EpochReclaimer<Node>::reclaim() {
+	std::lock_guard<std::mutex> hold(retired_lock);
+	return reclaim_locked();
+}
+
+template<typename Node>
+size_t EpochReclaimer<Node>::pending() {
+	std::lock_guard<std::mutex> hold(retired_lock);
+	return retired.size();
+}
+
+template<typename Node>
+bool EpochReclaimer<Node>::try_advance() {
+	uint64_t current = epoch.load();
+	for (Slot& slot : slots) {
+		uint64_t state = slot.state.load();
+		if (state != 0 && state != 2 * current + 1)
+			return false;
+	}
+	return epoch.compare_exchange_strong(current, current + 1);
+}
+
+template<typename Node>
+size_t EpochReclaimer<Node>::reclaim_locked() {
+	try_advance();
+	uint64_t safe = epoch.load();
+	size_t freed = 0;
+	while (freed < retired.size() && retired[freed].first + 2 <= safe)
+		delete retired[freed++].second;
+	retired.erase(retired.begin(), retired.begin() + freed);
+	return freed;
+}
+
+#endif
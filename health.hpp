@@ -0,0 +1,455 @@
+#ifndef HEALTH_HPP
+#define HEALTH_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Opt-in runtime health for the trees.
+// Every tree owns a TreeHealth, reached through health(). While it is enabled
+// one in every period inserts, erases and lookups is timed into an HDR-style
+// latency histogram; disabled, it is a null pointer and an operation pays a
+// single branch.
+// The monitor belongs to the tree object, moves and swaps of the contents
+// leave it where it is.
+// shape_report() walks the tree on demand for its depth distribution,
+// average search path and memory per key. A drift callback is checked on the
+// sampled operations against the ratio height / log2(nodes + 1) and, once that
+// passes its threshold, gets a full report. Nodes rather than values, so the
+// duplicates of a multiset do not hide an unbalanced shape. The trees keep no
+// count of their nodes, so the check estimates it from the last report in
+// O(1) and only marks the drift pending. The walk that confirms it is left to
+// the next poll() or shape_report() of the tree, outside any operation, so no
+// insert, erase or lookup ever pays for it.
+
+enum class TreeOp { insert, erase, lookup };
+
+// Counts values with a bounded relative error: below 2^sub_bits every value
+// has its own bucket, above that every power of two is cut into 2^sub_bits
+// equal buckets, so a bucket is never wider than 1/2^sub_bits of its values
+class LatencyHistogram {
+  public:
+	static const unsigned sub_bits = 5;
+
+	LatencyHistogram();
+	void record(uint64_t value);
+	void merge(const LatencyHistogram& other);
+	void reset();
+	uint64_t count() const;
+	uint64_t min() const;
+	uint64_t max() const;
+	double mean() const;
+	uint64_t percentile(double p) const;
+
+  private:
+	static const unsigned sub_buckets = 1u << sub_bits;
+	static const unsigned buckets = (65 - sub_bits) << sub_bits;
+	static unsigned bucket_of(uint64_t value);
+	static uint64_t bucket_max(unsigned bucket);
+	std::vector<uint64_t> counts; // allocated by the first record
+	uint64_t total, sum, smallest, largest;
+};
+
+struct ShapeReport {
+	size_t size;                      // values, with their multiplicities
+	size_t nodes;
+	unsigned height;
+	std::vector<size_t> depth_counts; // nodes at each depth, the root at 0
+	double average_path;              // nodes visited to reach a node, on average
+	double ideal_path;                // log2(nodes + 1), the height of a perfect tree
+	double path_ratio;                // average_path / ideal_path
+	double bytes_per_key;             // node memory over size, not counting what T owns
+	void print(std::ostream& out = std::cout) const;
+};
+
+class TreeHealth {
+  public:
+	typedef std::function<void(const ShapeReport&)> DriftCallback;
+
+	TreeHealth();
+	void enable(unsigned _period = 64);
+	void disable();
+	bool enabled() const;
+	bool active() const;
+	unsigned period() const;
+	void reset();
+	const LatencyHistogram& latency(TreeOp op) const;
+	void on_drift(double _threshold, DriftCallback _callback);
+	bool pending() const;
+	void print(std::ostream& out = std::cout) const;
+
+	static constexpr double rearm_share = 0.9;
+
+	// Used by HealthProbe
+	bool begin();
+	void end();
+	void record(TreeOp op, uint64_t nanoseconds);
+	template<typename Tree>
+	void check(Tree& tree);
+	// Used by shape_report and poll
+	bool observe(const ShapeReport& report);
+
+  private:
+	struct State {
+		bool on = false;
+		unsigned sample_period = 64, countdown = 64, nesting = 0;
+		LatencyHistogram histograms[3];
+		double threshold = 0;
+		bool alarmed = false; // the ratio is past the threshold and the callback has run
+		bool suspected = false; // the estimate passed the threshold, no report has confirmed it yet
+		DriftCallback callback;
+		double nodes_per_value = 0; // found by the last shape report, 0 before any
+	};
+	std::unique_ptr<State> state; // allocated by the first enable or on_drift
+	State& get_state();
+	bool over_threshold(unsigned height, double nodes);
+	bool confirm(const ShapeReport& report);
+	void notify(const ShapeReport& report);
+};
+
+// Scoped to a public operation of Tree: times it if the monitor samples it and
+// estimates the drift when it ends. Operations called from inside another one
+// are neither counted nor sampled
+template<typename Tree>
+class HealthProbe {
+  public:
+	HealthProbe(Tree& _tree, TreeOp _op);
+	HealthProbe(const HealthProbe&) = delete;
+	~HealthProbe();
+	HealthProbe& operator=(const HealthProbe&) = delete;
+
+  private:
+	Tree& tree;
+	TreeOp op;
+	bool tracked, sampled;
+	std::chrono::steady_clock::time_point start;
+};
+
+namespace __health_helper_methods {
+	template<typename Node>
+	ShapeReport shape_of(Node* root, size_t size, size_t node_bytes);
+}
+
+///////// Implementation Starts Here
+
+// LATENCY HISTOGRAM
+// -----------------
+
+inline LatencyHistogram::LatencyHistogram() : total(0), sum(0), smallest(UINT64_MAX), largest(0) {}
+
+inline unsigned LatencyHistogram::bucket_of(uint64_t value) {
+	if (value < sub_buckets)
+		return (unsigned) value;
+	unsigned exponent = 63 - __builtin_clzll(value);
+	unsigned shift = exponent - sub_bits;
+	return ((shift + 1) << sub_bits) + (unsigned) ((value >> shift) - sub_buckets);
+}
+
+inline uint64_t LatencyHistogram::bucket_max(unsigned bucket) {
+	if (bucket < sub_buckets)
+		return bucket;
+	unsigned shift = (bucket >> sub_bits) - 1;
+	uint64_t mantissa = (bucket & (sub_buckets - 1)) + sub_buckets;
+	return ((mantissa + 1) << shift) - 1;
+}
+
+inline void LatencyHistogram::record(uint64_t value) {
+	if (counts.empty())
+		counts.assign(buckets, 0);
+	counts[bucket_of(value)]++;
+	total++;
+	sum += value;
+	smallest = std::min(smallest, value);
+	largest = std::max(largest, value);
+}
+
+inline void LatencyHistogram::merge(const LatencyHistogram& other) {
+	if (other.total == 0)
+		return;
+	if (counts.empty())
+		counts.assign(buckets, 0);
+	for (unsigned i = 0; i < buckets; i++)
+		counts[i] += other.counts[i];
+	total += other.total;
+	sum += other.sum;
+	smallest = std::min(smallest, other.smallest);
+	largest = std::max(largest, other.largest);
+}
+
+inline void LatencyHistogram::reset() {
+	std::fill(counts.begin(), counts.end(), 0);
+	total = sum = largest = 0;
+	smallest = UINT64_MAX;
+}
+
+inline uint64_t LatencyHistogram::count() const {
+	return total;
+}
+
+inline uint64_t LatencyHistogram::min() const {
+	return (total == 0 ? 0 : smallest);
+}
+
+inline uint64_t LatencyHistogram::max() const {
+	return largest;
+}
+
+inline double LatencyHistogram::mean() const {
+	return (total == 0 ? 0 : (double) sum / total);
+}
+
+// The smallest bucket bound that at least p percent of the values are under
+inline uint64_t LatencyHistogram::percentile(double p) const {
+	if (total == 0)
+		return 0;
+	uint64_t rank = (uint64_t) std::ceil(std::clamp(p, 0.0, 100.0) / 100 * total);
+	rank = std::max<uint64_t>(rank, 1);
+	uint64_t seen = 0;
+	for (unsigned i = 0; i < buckets; i++) {
+		seen += counts[i];
+		if (seen >= rank)
+			return std::clamp(bucket_max(i), min(), largest);
+	}
+	return largest;
+}
+
+// SHAPE REPORT
+// ------------
+
+inline void ShapeReport::print(std::ostream& out) const {
+	out << "size " << size << ", nodes " << nodes << ", height " << height << std::endl;
+	out << "average path " << average_path << " vs log2 " << ideal_path << " (x" << path_ratio << ")" << std::endl;
+	out << "bytes per key " << bytes_per_key << std::endl;
+	out << "depth";
+	for (size_t count : depth_counts)
+		out << " " << count;
+	out << std::endl;
+}
+
+// Iterative, so a degenerate tree cannot overflow the stack. node_bytes is
+// what one node really allocates, more than sizeof(Node) when padded to a Slot
+template<typename Node>
+ShapeReport __health_helper_methods::shape_of(Node* root, size_t size, size_t node_bytes) {
+	ShapeReport report{size, 0, 0, {}, 0, 0, 0, 0};
+	double total_path = 0;
+	std::vector<std::pair<Node*, unsigned>> stk;
+	if (root != nullptr)
+		stk.emplace_back(root, 0);
+	while (!stk.empty()) {
+		auto [node, depth] = stk.back();
+		stk.pop_back();
+		if (report.depth_counts.size() <= depth)
+			report.depth_counts.resize(depth + 1, 0);
+		report.depth_counts[depth]++;
+		report.nodes++;
+		total_path += depth + 1;
+		if (node->left != nullptr) stk.emplace_back(node->left, depth + 1);
+		if (node->right != nullptr) stk.emplace_back(node->right, depth + 1);
+	}
+
+	report.height = report.depth_counts.size();
+	report.ideal_path = std::log2((double) report.nodes + 1);
+	if (report.nodes > 0) {
+		report.average_path = total_path / report.nodes;
+		report.path_ratio = report.average_path / report.ideal_path;
+	}
+	if (size > 0)
+		report.bytes_per_key = (double) (report.nodes * node_bytes) / size;
+	return report;
+}
+
+// TREE HEALTH
+// -----------
+
+inline TreeHealth::TreeHealth() {}
+
+inline TreeHealth::State& TreeHealth::get_state() {
+	if (state == nullptr)
+		state = std::make_unique<State>();
+	return *state;
+}
+
+// One in every _period operations is timed
+inline void TreeHealth::enable(unsigned _period) {
+	State& st = get_state();
+	st.on = true;
+	st.sample_period = st.countdown = std::max(1u, _period);
+}
+
+inline void TreeHealth::disable() {
+	if (state != nullptr)
+		state->on = false;
+}
+
+inline bool TreeHealth::enabled() const {
+	return state != nullptr && state->on;
+}
+
+// Whether operations are sampled at all, for timing or for the drift check
+inline bool TreeHealth::active() const {
+	return state != nullptr && (state->on || state->callback);
+}
+
+inline unsigned TreeHealth::period() const {
+	return (state == nullptr ? 0 : state->sample_period);
+}
+
+inline void TreeHealth::reset() {
+	if (state == nullptr)
+		return;
+	for (LatencyHistogram& histogram : state->histograms)
+		histogram.reset();
+	state->alarmed = state->suspected = false;
+}
+
+// Latencies in nanoseconds
+inline const LatencyHistogram& TreeHealth::latency(TreeOp op) const {
+	static const LatencyHistogram none;
+	return (state == nullptr ? none : state->histograms[(int) op]);
+}
+
+// callback runs once height / log2(nodes + 1) is above _threshold, and again
+// only after the ratio has been back under rearm_share of it, so a shape
+// hovering at the threshold does not fire on every sample. It needs no
+// enable: the same one in every period() operations estimates the ratio, with
+// or without timing, until a null callback. A drift found there is only
+// pending, the callback runs from the poll() or shape_report() that confirms
+// it, so it may rebuild the tree. Operations it makes on the tree are not
+// counted, and an exception it throws is caught and dropped
+inline void TreeHealth::on_drift(double _threshold, DriftCallback _callback) {
+	State& st = get_state();
+	st.threshold = _threshold;
+	st.callback = _callback;
+	st.alarmed = st.suspected = false;
+}
+
+// Whether a drift awaits the report that confirms it
+inline bool TreeHealth::pending() const {
+	return state != nullptr && state->suspected;
+}
+
+inline void TreeHealth::print(std::ostream& out) const {
+	const char* names[] = {"insert", "erase", "lookup"};
+	out << "op\tsamples\tmean\tp50\tp90\tp99\tp99.9\tmax\t(ns, 1 in " << period() << ")" << std::endl;
+	for (int i = 0; i < 3; i++) {
+		const LatencyHistogram& h = latency((TreeOp) i);
+		out << names[i] << "\t" << h.count() << "\t" << h.mean() << "\t" << h.percentile(50) << "\t" << h.percentile(90)
+		    << "\t" << h.percentile(99) << "\t" << h.percentile(99.9) << "\t" << h.max() << std::endl;
+	}
+}
+
+// The rest is only called while active.
+// Whether the operation starting now is sampled
+inline bool TreeHealth::begin() {
+	if (state->nesting++ > 0 || --state->countdown > 0)
+		return false;
+	state->countdown = state->sample_period;
+	return true;
+}
+
+inline void TreeHealth::end() {
+	state->nesting--;
+}
+
+inline void TreeHealth::record(TreeOp op, uint64_t nanoseconds) {
+	state->histograms[(int) op].record(nanoseconds);
+}
+
+// Whether the ratio is past the threshold with the alarm not yet raised. A
+// ratio back under rearm_share of the threshold lowers the alarm
+inline bool TreeHealth::over_threshold(unsigned height, double nodes) {
+	double ratio = height / std::log2(nodes + 1);
+	if (ratio < rearm_share * state->threshold)
+		state->alarmed = false;
+	return ratio > state->threshold && !state->alarmed;
+}
+
+// O(1), the tree is not walked. The nodes are estimated by scaling the size
+// with the nodes per value of the last shape report. Before any report the
+// height is taken instead, which is never more than the nodes, so a drift is
+// never missed and the first check leaves a report to confirm it
+template<typename Tree>
+void TreeHealth::check(Tree& tree) {
+	if (!state->callback)
+		return;
+	size_t size = tree.size();
+	if (size == 0)
+		return;
+	unsigned height = tree.height();
+	double nodes = (state->nodes_per_value > 0 ? std::clamp(size * state->nodes_per_value, 1.0, (double) size) : height);
+	if (over_threshold(height, nodes))
+		state->suspected = true;
+}
+
+// Checks a drift found by the estimate against the counts of a fresh report
+// and raises the alarm if it holds
+inline bool TreeHealth::confirm(const ShapeReport& report) {
+	if (!over_threshold(report.height, std::max<double>(1, report.nodes)))
+		return false;
+	state->alarmed = true;
+	return true;
+}
+
+// Through a copy, so the callback may replace itself. Counted as nested, so
+// the operations it makes are not sampled
+inline void TreeHealth::notify(const ShapeReport& report) {
+	DriftCallback callback = state->callback;
+	state->nesting++;
+	try {
+		callback(report);
+	} catch (...) {
+	}
+	state->nesting--;
+}
+
+// Called by every shape_report, which keeps the node estimate of check
+// current and settles a pending drift. Returns whether the callback ran
+inline bool TreeHealth::observe(const ShapeReport& report) {
+	if (state == nullptr)
+		return false;
+	if (report.size > 0)
+		state->nodes_per_value = (double) report.nodes / report.size;
+	if (!state->suspected || !state->callback)
+		return false;
+	state->suspected = false;
+	if (!confirm(report))
+		return false;
+	notify(report);
+	return true;
+}
+
+// HEALTH PROBE
+// ------------
+
+template<typename Tree>
+HealthProbe<Tree>::HealthProbe(Tree& _tree, TreeOp _op) : tree(_tree), op(_op), tracked(_tree.health().active()), sampled(false) {
+	if (tracked) {
+		sampled = tree.health().begin();
+		if (sampled && tree.health().enabled())
+			start = std::chrono::steady_clock::now();
+	}
+}
+
+template<typename Tree>
+HealthProbe<Tree>::~HealthProbe() {
+	if (!tracked)
+		return;
+	TreeHealth& monitor = tree.health();
+	if (sampled) {
+		if (monitor.enabled()) {
+			std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+			monitor.record(op, elapsed.count());
+		}
+		monitor.check(tree);
+	}
+	monitor.end();
+}
+
+#endif
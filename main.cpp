@@ -1,42 +1,691 @@
-//#include "treap.hpp"
+#include "treap.hpp"
 #include "avl.hpp"
-//#include "splay_tree.hpp"
+#include "splay_tree.hpp"
+#include "adaptive_set.hpp"
+#include "splay_cache.hpp"
 #include <iostream>
+#include <algorithm>
 #include <cassert>
-#include <set>
+#include <cmath>
+#include <functional>
+#include <iterator>
+#include <list>
 #include <map>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
 using namespace std;
 
-int main(int argc, char** argv) {
-	srand(atoi(argv[1]));
+// Random ops on every tree, as a set and as a multiset, checked against std::multiset
+//   ./main <seed>
 
-	set<int> S;
-	AVL<int> T;
+// The values of T in order, copies included
+template<typename Tree>
+vector<int> values_of(Tree& T) {
+	vector<int> values;
+	T.parallel_for_each([&](const int& value) { values.push_back(value); }, 1);
+	return values;
+}
 
-	int n = 100;
-	map<int, int> mp;
+// The value type and comparator of each tree, so check_tree can keep a
+// std::multiset in the same order
+template<typename Tree>
+struct tree_traits;
+
+template<typename T, typename Compare, size_t Slot>
+struct tree_traits<AVL<T, Compare, Slot>> { typedef T value; typedef Compare compare; };
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+struct tree_traits<Treap<T, Compare, Canonical, Slot>> { typedef T value; typedef Compare compare; };
+
+template<typename T, typename Compare, size_t Slot>
+struct tree_traits<SplayTree<T, Compare, Slot>> { typedef T value; typedef Compare compare; };
+
+// The random values of check_tree. Prefixed keys mix short ones with long ones
+// sharing their first 8 bytes, so both halves of PrefixedCompare are taken
+template<typename V>
+V make_value(int value);
+
+template<>
+int make_value<int>(int value) { return value; }
+
+template<>
+string make_value<string>(int value) { return to_string(value); }
+
+template<>
+PrefixedString make_value<PrefixedString>(int value) { return PrefixedString((value % 4 == 0 ? "p" : "shared/prefix/") + to_string(value)); }
+
+// Random ops checked against a std::multiset, and every invariant the tree's
+// verify knows checked after each of them. setup, if given, configures the tree first
+template<typename Tree>
+void check_tree(const string& name, bool multi, int n, const function<void(Tree&)>& setup = nullptr) {
+	typedef typename tree_traits<Tree>::value V;
+	typedef typename tree_traits<Tree>::compare Compare;
+	multiset<V, Compare> S;
+	Tree T(multi);
+	if (setup)
+		setup(T);
+	auto same = [&](const V& a, const V& b) { return !S.key_comp()(a, b) && !S.key_comp()(b, a); };
+
+	for (int i = 0; i < 4 * n; i++) {
+		V value = make_value<V>(rand() % n);
+
+		int coin = rand() % 7;
+
+		if (coin == 0 || coin == 1) {
+			bool fresh = (S.count(value) == 0);
+			if (multi || fresh)
+				S.insert(value);
+			assert(T.insert(value) == (multi || fresh));
+		} else if (coin == 2) {
+			auto it = S.find(value);
+			bool found = (it != S.end());
+			if (found) S.erase(it);
+			assert(T.erase_one(value) == found);
+		} else if (coin == 3) {
+			// erase is erase_all reporting only whether anything was removed
+			if (rand() % 2)
+				assert(T.erase_all(value) == S.erase(value));
+			else
+				assert(T.erase(value) == (S.erase(value) > 0));
+		} else if (coin == 4) {
+			// Both halves keep their counts across a split and the join back,
+			// and whatever other held before the split is dropped
+			Tree other(multi);
+			if (rand() % 2) {
+				other.insert(value);
+				other.insert(value);
+			}
+			T.split(value, other);
+			assert(other.verify());
+			assert(T.size() == (unsigned) distance(S.begin(), S.lower_bound(value)));
+			assert(other.size() == S.size() - T.size());
+			assert(other.count(value) == S.count(value) && T.count(value) == 0);
+			T.join(other);
+			assert(other.empty());
+		} else if (coin == 5) {
+			// Popping an end must also leave the cached ends right
+			if (!S.empty()) {
+				bool smallest = rand() % 2;
+				auto it = (smallest ? S.begin() : prev(S.end()));
+				assert(same((smallest ? T.pop_min() : T.pop_max()), *it));
+				S.erase(it);
+			}
+			if (!S.empty())
+				assert(same(T.min(), *S.begin()) && same(T.max(), *S.rbegin()));
+		} else {
+			assert(T.count(value) == S.count(value));
+			assert(T.contains(value) == (S.count(value) > 0));
+			// String keys are also found by string_view, without a temporary key
+			if constexpr (is_same<V, string>::value)
+				assert(T.count(string_view(value)) == S.count(value) && T.contains(string_view(value)) == (S.count(value) > 0));
+			if constexpr (is_same<V, PrefixedString>::value)
+				assert(T.count(string_view(value.str)) == S.count(value) && T.contains(string_view(value.str)) == (S.count(value) > 0));
+			assert(T.rank(value) == (unsigned) distance(S.begin(), S.lower_bound(value)));
+			if (!S.empty()) {
+				unsigned k = rand() % S.size();
+				assert(same(T.kth(k), *next(S.begin(), k)));
+			}
+		}
+		assert(S.size() == T.size() && T.verify());
+	}
+	cout << name << (multi ? " multiset" : " set") << ": " << S.size() << " values, height " << T.height() << endl;
+}
+
+// A stretch of values folded by parallel_reduce and whether they came in order
+struct Run {
+	bool empty;
+	int first, last;
+	bool ordered;
+};
+
+Run concat(const Run& a, const Run& b) {
+	if (a.empty) return b;
+	if (b.empty) return a;
+	return {false, a.first, b.last, a.ordered && b.ordered && a.last <= b.first};
+}
+
+// The parallel scans on more than grain values, so the forked paths run, with
+// one thread and with several. for_each may visit in any order once forked,
+// reduce must still fold in order and filter must return a valid tree of its own
+template<typename Tree>
+void check_parallel(const string& name, bool multi, int n) {
+	multiset<int> S;
+	Tree T(multi);
+	for (int i = 0; i < 2 * n; i++) {
+		int value = rand() % n;
+		if (T.insert(value))
+			S.insert(value);
+	}
+	assert(T.size() == S.size() && T.verify());
+	vector<int> expected(S.begin(), S.end());
+
+	for (unsigned threads : {1u, 4u}) {
+		vector<int> seen;
+		mutex lock;
+		T.parallel_for_each([&](const int& value) { lock_guard<mutex> hold(lock); seen.push_back(value); }, threads);
+		if (threads > 1)
+			sort(seen.begin(), seen.end());
+		assert(seen == expected);
+
+		long long sum = T.parallel_reduce(0ll, [](const int& value) { return (long long) value; }, plus<long long>(), threads);
+		assert(sum == accumulate(expected.begin(), expected.end(), 0ll));
+		Run run = T.parallel_reduce(Run{true, 0, 0, true}, [](const int& value) { return Run{false, value, value, true}; }, concat, threads);
+		assert(!run.empty && run.ordered && run.first == expected.front() && run.last == expected.back());
+
+		auto pred = [](const int& value) { return value % 3 != 0; };
+		Tree F = T.parallel_filter(pred, threads);
+		assert(T.size() == S.size() && T.verify());
+		vector<int> kept;
+		copy_if(expected.begin(), expected.end(), back_inserter(kept), pred);
+		assert(values_of(F) == kept && F.size() == kept.size() && F.verify());
+		assert(F.min() == kept.front() && F.max() == kept.back() && F.verify());
+		assert(F.pop_min() == kept.front() && F.pop_max() == kept.back() && F.verify());
+	}
+	cout << name << (multi ? " multiset" : " set") << ": parallel scans over " << S.size() << " values" << endl;
+}
+
+// The same scans over a splay tree grown in ascending order, which makes it a
+// path of n nodes. Past the forks every subtree is walked without recursion
+void check_parallel_path(int n) {
+	SplayTree<int> T;
+	for (int value = 0; value < n; value++)
+		T.insert(value);
+	assert(T.height() == (unsigned) n);
+
+	for (unsigned threads : {1u, 4u}) {
+		long long count = 0;
+		mutex lock;
+		T.parallel_for_each([&](const int&) { lock_guard<mutex> hold(lock); count++; }, threads);
+		assert(count == n);
+		Run run = T.parallel_reduce(Run{true, 0, 0, true}, [](const int& value) { return Run{false, value, value, true}; }, concat, threads);
+		assert(!run.empty && run.ordered && run.first == 0 && run.last == n - 1);
+		SplayTree<int> F = T.parallel_filter([](const int& value) { return value % 2 == 0; }, threads);
+		assert(F.size() == (unsigned) (n + 1) / 2 && F.height() < T.height() / 2 && F.verify());
+	}
+	cout << "Splay path: parallel scans over " << n << " values" << endl;
+}
+
+// build from unsorted values with duplicates, with one thread and with
+// several, replacing what the tree held. Enough values that the sort, the
+// runs and the canonical chunks are split. An empty range leaves the tree empty
+template<typename Tree>
+void check_build(const string& name, bool multi, int n) {
+	vector<int> values;
+	for (int i = 0; i < 2 * n; i++)
+		values.push_back(rand() % n);
+	vector<int> expected(values);
+	sort(expected.begin(), expected.end());
+	if (!multi)
+		expected.erase(unique(expected.begin(), expected.end()), expected.end());
+
+	for (unsigned threads : {1u, 4u}) {
+		Tree T(multi);
+		T.insert(-1);
+		T.build(values.begin(), values.end(), threads);
+		assert(values_of(T) == expected && T.size() == expected.size() && T.verify());
+		assert(T.min() == expected.front() && T.max() == expected.back());
+		assert(T.insert(n) && T.erase_one(n) && T.verify());
+
+		// The same shape as inserting, so the hashes agree
+		if constexpr (is_same<Tree, CanonicalTreap<int>>::value) {
+			Tree inserted(multi);
+			for (int value : values)
+				inserted.insert(value);
+			assert(T.equals(inserted) && T.height() == inserted.height());
+		}
+
+		T.build(values.end(), values.end(), threads);
+		assert(T.empty() && T.verify());
+	}
+	cout << name << (multi ? " multiset" : " set") << ": built " << expected.size() << " values from " << values.size() << endl;
+}
+
+// Random [lo, hi] windows taken out with extract_range or erase_range, some
+// empty or with lo > hi, some reaching past the smallest or largest value,
+// checked against std::multiset along with both cached ends. The nodes of
+// erase_range are then reclaimed a few at a time until none are left
+template<typename Tree>
+void check_range(const string& name, bool multi, int n) {
+	multiset<int> S;
+	Tree T(multi);
+	assert(T.extract_range(0, n).empty() && T.erase_range(0, n) == 0 && T.verify());
+	size_t erased = 0;
+
+	for (int round = 0; round < n; round++) {
+		for (int i = 0; i < n / 4; i++) {
+			int value = rand() % n;
+			if (T.insert(value))
+				S.insert(value);
+		}
+		int lo = rand() % n, hi = rand() % n;
+		int kind = rand() % 4;
+		if (kind == 0)
+			lo = (rand() % 2 ? -1 : *S.begin());
+		else if (kind == 1)
+			hi = (rand() % 2 ? n : *S.rbegin());
+		auto first = S.lower_bound(lo), last = (lo <= hi ? S.upper_bound(hi) : first);
+		vector<int> expected(first, last);
+
+		if (rand() % 2) {
+			Tree range = T.extract_range(lo, hi);
+			assert(values_of(range) == expected && range.size() == expected.size() && range.verify());
+			if (!expected.empty())
+				assert(range.min() == expected.front() && range.max() == expected.back() && range.verify());
+		} else {
+			assert(T.erase_range(lo, hi) == expected.size());
+			erased += expected.size();
+		}
+		S.erase(first, last);
+		assert(T.size() == S.size() && T.verify());
+		if (!S.empty())
+			assert(T.min() == *S.begin() && T.max() == *S.rbegin() && T.verify());
+	}
+
+	// A set has a node per value, a multiset at most that many
+	size_t freed, reclaimed = 0;
+	while ((freed = T.reclaim(3)) > 0) {
+		assert(freed <= 3);
+		reclaimed += freed;
+	}
+	assert(multi ? reclaimed <= erased : reclaimed == erased);
+	assert(T.reclaim() == 0 && T.size() == S.size() && T.verify());
+	cout << name << (multi ? " multiset" : " set") << ": erased " << erased << " values in ranges, reclaimed " << reclaimed << " nodes" << endl;
+}
+
+// Copies, clones and moves of a tree against a std::multiset each. A copy must
+// not share nodes with its source, a moved-from tree must be empty and usable,
+// and swap must trade the contents while each tree keeps its health monitor
+template<typename Tree>
+void check_copy(const string& name, bool multi, int n) {
+	multiset<int> SA;
+	Tree A(multi);
 	for (int i = 0; i < n; i++) {
 		int value = rand() % n;
-		mp[value]++;
+		if (A.insert(value))
+			SA.insert(value);
+	}
+	auto matches = [](Tree& T, const multiset<int>& S) {
+		return values_of(T) == vector<int>(S.begin(), S.end()) && T.size() == S.size() && T.verify()
+		    && (S.empty() || (T.min() == *S.begin() && T.max() == *S.rbegin()));
+	};
+	auto mutate = [&](Tree& T, multiset<int>& S) {
+		for (int i = 0; i < n / 4; i++) {
+			int value = rand() % (2 * n);
+			if (rand() % 2) {
+				if (T.insert(value))
+					S.insert(value);
+			} else if (T.erase_one(value)) {
+				S.erase(S.find(value));
+			}
+		}
+		if (!S.empty()) {
+			assert(T.pop_min() == *S.begin());
+			S.erase(S.begin());
+		}
+	};
 
-		int coin = rand() % 2; // testing only inserts
+	Tree B(A);
+	multiset<int> SB(SA);
+	mutate(B, SB);
+	assert(matches(A, SA) && matches(B, SB));
+	mutate(A, SA);
+	assert(matches(A, SA) && matches(B, SB));
 
-		if (coin == 0) {
-			S.insert(value);
-			if (value == 11 && mp[value] == 2) {}
-			else T.insert(value);
-			cout << "Inserted " << value << ": " << S.size() << " " << T.height() << endl;
-		} else if (coin == 1) {
-			S.erase(value);
-			bool ret = T.erase(value);
-			if (ret)
-				cout << "Erased " << value << ": " << S.size() << " " << T.height() << endl;
-			else
-				cout << "Tried to erase " << value << endl;
+	Tree C(multi), D = A.clone(4);
+	C.insert(n);
+	C = B;
+	Tree& same = C;
+	C = same;
+	multiset<int> SC(SB), SD(SA);
+	mutate(B, SB);
+	mutate(D, SD);
+	assert(matches(A, SA) && matches(B, SB) && matches(C, SC) && matches(D, SD));
+
+	// Moved-from trees are empty and take new values
+	Tree E(std::move(C));
+	assert(matches(E, SC) && matches(C, {}));
+	Tree F(multi);
+	F.insert(n);
+	F = std::move(E);
+	assert(matches(F, SC) && matches(E, {}));
+	multiset<int> SMC, SME;
+	mutate(C, SMC);
+	mutate(E, SME);
+	assert(matches(C, SMC) && matches(E, SME));
+
+	A.health().enable(1);
+	A.swap(B);
+	swap(SA, SB);
+	assert(matches(A, SA) && matches(B, SB));
+	assert(A.health().enabled() && !B.health().enabled());
+	cout << name << (multi ? " multiset" : " set") << ": copies of " << SA.size() << " and " << SB.size() << " values" << endl;
+}
+
+// Canonical treaps built from the same values in different orders, with
+// detours through erases and a split, must hash equal. diff against a treap
+// with other values must give the two sides of std::set_symmetric_difference
+template<typename Tree>
+void check_diff(const string& name, bool multi, int n) {
+	mt19937 gen(rand());
+	vector<int> values;
+	for (int i = 0; i < n; i++)
+		values.push_back(rand() % n);
+	if (!multi) {
+		sort(values.begin(), values.end());
+		values.erase(unique(values.begin(), values.end()), values.end());
+	}
+
+	Tree A(multi), B(multi);
+	for (int value : values)
+		A.insert(value);
+	shuffle(values.begin(), values.end(), gen);
+	for (int value : values) {
+		B.insert(value);
+		B.insert(n + value);
+	}
+	Tree upper(multi);
+	B.split(n, upper);
+	B.join(upper);
+	for (int value : values)
+		B.erase_one(n + value);
+	assert(A.equals(B));
+
+	// B keeps most of A, so diff can skip the subtrees whose hashes still match
+	multiset<int> SA(values.begin(), values.end()), SB;
+	for (int value : values)
+		if (rand() % 8 != 0)
+			SB.insert(value);
+	for (int i = 0; i < n / 8; i++) {
+		int value = rand() % (2 * n);
+		if (multi || SB.count(value) == 0)
+			SB.insert(value);
+	}
+	B.clear();
+	for (int value : SB)
+		B.insert(value);
+
+	vector<int> only_a, only_b, expected_a, expected_b, symmetric;
+	Tree::diff(A, B, only_a, only_b);
+	sort(only_a.begin(), only_a.end());
+	sort(only_b.begin(), only_b.end());
+	set_difference(SA.begin(), SA.end(), SB.begin(), SB.end(), back_inserter(expected_a));
+	set_difference(SB.begin(), SB.end(), SA.begin(), SA.end(), back_inserter(expected_b));
+	set_symmetric_difference(SA.begin(), SA.end(), SB.begin(), SB.end(), back_inserter(symmetric));
+	assert(only_a == expected_a && only_b == expected_b);
+	assert(only_a.size() + only_b.size() == symmetric.size());
+	assert(A.equals(B) == symmetric.empty());
+	cout << name << (multi ? " multiset" : " set") << ": diff " << only_a.size() << " + " << only_b.size() << endl;
+}
+
+// AdaptiveSet through three phases, each long enough for two windows to agree:
+// uniform updates and reads stay on the AVL tree, split and join churn moves
+// to the treap and reads of a few hot values to the splay tree
+void check_adaptive(int n) {
+	set<int> S;
+	AdaptiveSet<int> A;
+	int ops = 4 * AdaptiveSet<int>::min_window;
+	int hot[16];
+	for (int& value : hot)
+		value = rand() % n;
+
+	auto check_contents = [&](Backing expected) {
+		assert(A.backing() == expected);
+		assert(A.size() == S.size());
+		for (int value = 0; value < n; value++)
+			assert(A.contains(value) == (S.count(value) > 0));
+	};
+
+	for (Backing phase : {Backing::avl, Backing::treap, Backing::splay}) {
+		for (int i = 0; i < ops; i++) {
+			int value = rand() % n;
+			int coin = rand() % 100;
+			if (phase == Backing::splay && coin < 95) {
+				value = hot[rand() % 16];
+				assert(A.contains(value) == (S.count(value) > 0));
+			} else if (phase == Backing::treap && coin < 5) {
+				// Whatever upper held before the split is dropped
+				AdaptiveSet<int> upper;
+				if (rand() % 2)
+					upper.insert(n + rand() % n);
+				A.split(value, upper);
+				assert(upper.size() == (unsigned) distance(S.lower_bound(value), S.end()));
+				assert(A.size() == (unsigned) distance(S.begin(), S.lower_bound(value)));
+				assert(A.join(upper) && upper.empty());
+			} else if (coin < 30) {
+				assert(A.insert(value) == S.insert(value).second);
+			} else if (coin < 60) {
+				A.erase(value);
+				S.erase(value);
+			} else {
+				assert(A.contains(value) == (S.count(value) > 0));
+			}
+		}
+		check_contents(phase);
+	}
+	A.convert(Backing::avl);
+	check_contents(Backing::avl);
+	cout << "AdaptiveSet: " << S.size() << " values" << endl;
+}
+
+// The drift callback on a splay tree grown in ascending order, which makes it
+// a path. The inserts only leave the drift pending, and each episode must fire
+// exactly once from the poll after them, whether or not the latencies are
+// timed. A callback that throws must not reach the caller. Between episodes a
+// single value takes the ratio back under the rearm share
+void check_drift(bool timed, bool throwing, int n) {
+	SplayTree<int> T;
+	unsigned calls = 0;
+	if (timed)
+		T.health().enable(8);
+	T.health().on_drift(3, [&](const ShapeReport& report) {
+		calls++;
+		assert(report.nodes == T.size() && report.height == report.nodes && report.height / report.ideal_path > 3);
+		if (throwing)
+			throw runtime_error("drift");
+	});
+	unsigned period = T.health().period();
+
+	for (int episode = 1; episode <= 3; episode++) {
+		for (int value = 0; value < n; value++)
+			T.insert(value);
+		assert(calls == (unsigned) episode - 1 && T.health().pending());
+		assert(T.poll() && !T.poll());
+		assert(calls == (unsigned) episode && T.verify());
+		T.clear();
+		T.insert(0);
+		for (unsigned i = 0; i < 2 * period; i++)
+			assert(T.contains(0));
+		assert(!T.poll() && calls == (unsigned) episode);
+	}
+	T.health().on_drift(0, nullptr);
+	for (int value = 0; value < n; value++)
+		T.insert(value);
+	assert(!T.poll() && calls == 3 && T.health().active() == timed);
+	assert((T.health().latency(TreeOp::insert).count() > 0) == timed && (T.health().latency(TreeOp::lookup).count() > 0) == timed);
+	cout << "Drift" << (timed ? " timed" : "") << (throwing ? " throwing" : "") << ": " << calls << " episodes" << endl;
+}
+
+// Percentiles of 1..n stay within a bucket's width above the exact ones, both
+// recorded directly and merged from two halves. Memory per key counts the
+// Slot a node is padded to
+void check_histogram(int n) {
+	LatencyHistogram whole, low, high;
+	for (int value = n; value >= 1; value--) {
+		whole.record(value);
+		(value <= n / 2 ? low : high).record(value);
+	}
+	low.merge(high);
+	for (const LatencyHistogram* h : {&whole, &low}) {
+		assert(h->count() == (uint64_t) n && h->min() == 1 && h->max() == (uint64_t) n && h->mean() == (n + 1) / 2.0);
+		for (double p : {0.0, 1.0, 50.0, 90.0, 99.0, 99.9, 100.0}) {
+			uint64_t exact = max<uint64_t>(1, (uint64_t) ceil(p / 100 * n));
+			uint64_t found = h->percentile(p);
+			assert(exact <= found && found <= exact + (exact >> LatencyHistogram::sub_bits));
+			assert(exact >= (1u << LatencyHistogram::sub_bits) || found == exact);
+		}
+	}
+	assert(whole.percentile(100) == (uint64_t) n && whole.percentile(0) == 1);
+
+	AVL<int> plain;
+	AVL<int, less<int>, 64> padded;
+	for (int value = 0; value < n; value++) {
+		plain.insert(value);
+		padded.insert(value);
+	}
+	assert(plain.shape_report().bytes_per_key == sizeof(AVL<int>::Node));
+	assert(padded.shape_report().bytes_per_key == 64);
+	cout << "LatencyHistogram: p50 " << whole.percentile(50) << ", p99 " << whole.percentile(99) << " of " << n << endl;
+}
+
+// LRU reference for SplayCache: the values by key and the keys oldest first,
+// each entry charged a node plus the length of its value
+struct LRUModel {
+	size_t capacity, byte_budget, node_bytes, used, evicted;
+	map<int, string> values;
+	list<int> order;
+	map<int, list<int>::iterator> position;
+
+	LRUModel(size_t _capacity, size_t _byte_budget, size_t _node_bytes)
+		: capacity(_capacity), byte_budget(_byte_budget), node_bytes(_node_bytes), used(0), evicted(0) {}
+
+	size_t charge(const string& value) { return node_bytes + value.size(); }
+
+	void remove(int key) {
+		used -= charge(values[key]);
+		order.erase(position[key]);
+		position.erase(key);
+		values.erase(key);
+	}
+
+	void trim() {
+		while (!order.empty() && ((capacity != 0 && values.size() > capacity) || (byte_budget != 0 && used > byte_budget))) {
+			remove(order.front());
+			evicted++;
+		}
+	}
+
+	bool put(int key, const string& value) {
+		bool created = (values.count(key) == 0);
+		if (!created)
+			remove(key);
+		values[key] = value;
+		used += charge(value);
+		position[key] = order.insert(order.end(), key);
+		trim();
+		return created;
+	}
+
+	const string* get(int key) {
+		if (values.count(key) == 0) return nullptr;
+		order.erase(position[key]);
+		position[key] = order.insert(order.end(), key);
+		return &values[key];
+	}
+};
+
+// Random puts, gets, peeks, erases and range scans on a SplayCache bounded by
+// entries, bytes or both, checked against LRUModel after every op. The whole
+// contents are compared with peek, so an entry evicted out of order shows up
+void check_cache(size_t capacity, size_t byte_budget, int keys, int n) {
+	typedef SplayCache<int, string> Cache;
+	size_t node_bytes = sizeof(SNode<Cache::Entry, Cache::EntryCompare>);
+	Cache C(capacity, byte_budget);
+	C.set_weigher([](const int&, const string& value) { return value.size(); });
+	LRUModel M(capacity, byte_budget, node_bytes);
+
+	for (int i = 0; i < n; i++) {
+		int key = rand() % keys;
+		int coin = rand() % 10;
+		if (coin < 4) {
+			string value(rand() % 64, 'a' + rand() % 26);
+			assert(C.put(key, value) == M.put(key, value));
+		} else if (coin < 7) {
+			const string* expected = M.get(key);
+			string* found = C.get(key);
+			assert((found == nullptr) == (expected == nullptr));
+			assert(found == nullptr || *found == *expected);
+		} else if (coin < 8) {
+			bool present = (M.values.count(key) > 0);
+			if (present)
+				M.remove(key);
+			assert(C.erase(key) == present);
 		} else {
-			//assert(S.count(value) == T.contains(value));
+			int lo = key, hi = key + rand() % (keys / 4 + 1);
+			vector<pair<int, string>> seen;
+			C.for_range(lo, hi, [&](const int& k, const string& value) { seen.emplace_back(k, value); });
+			vector<pair<int, string>> expected(M.values.lower_bound(lo), M.values.upper_bound(hi));
+			assert(seen == expected);
+		}
+
+		assert(C.size() == M.values.size() && C.bytes() == M.used && C.evictions() == M.evicted);
+		for (int k = 0; k < keys; k++) {
+			const string* found = C.peek(k);
+			assert((found == nullptr) == (M.values.count(k) == 0));
+			assert(found == nullptr || *found == M.values[k]);
 		}
+	}
+	cout << "SplayCache " << capacity << " entries, " << byte_budget << " bytes: " << C.evictions() << " evictions" << endl;
+}
+
+int main(int argc, char** argv) {
+	srand(atoi(argv[1]));
 
-		//T.print();
+	int n = 100;
+	for (bool multi : {false, true}) {
+		check_tree<AVL<int>>("AVL", multi, n);
+		check_tree<Treap<int>>("Treap", multi, n);
+		check_tree<SplayTree<int>>("Splay", multi, n);
+		check_tree<AVL<string, less<>>>("AVL of strings", multi, n);
+		check_tree<Treap<PrefixedString, PrefixedCompare>>("Treap of prefixed strings", multi, n);
+		check_tree<SplayTree<int, greater<int>>>("Splay in descending order", multi, n);
+	}
+	// Every splay policy, with lookups left alone and restructuring. The depth
+	// threshold is lowered so that trees of this size do get splayed
+	const char* policies[] = {"full", "semi", "depth threshold", "randomized"};
+	for (bool multi : {false, true})
+		for (SplayPolicy policy : {SplayPolicy::full, SplayPolicy::semi, SplayPolicy::depth_threshold, SplayPolicy::randomized})
+			for (bool splay_lookups : {false, true})
+				check_tree<SplayTree<int>>(string("Splay ") + policies[(int) policy] + (splay_lookups ? ", splayed lookups," : ","), multi, n,
+					[&](SplayTree<int>& T) { T.set_policy(policy, (policy == SplayPolicy::depth_threshold ? 1 : 0), splay_lookups); });
+	for (bool multi : {false, true}) {
+		check_parallel<AVL<int>>("AVL", multi, 320 * n);
+		check_parallel<Treap<int>>("Treap", multi, 320 * n);
+		check_parallel<SplayTree<int>>("Splay", multi, 320 * n);
+	}
+	check_parallel_path(500 * n);
+	for (bool multi : {false, true}) {
+		check_copy<AVL<int>>("AVL", multi, n);
+		check_copy<Treap<int>>("Treap", multi, n);
+		check_copy<SplayTree<int>>("Splay", multi, n);
+	}
+	for (bool multi : {false, true}) {
+		check_range<AVL<int>>("AVL", multi, n);
+		check_range<Treap<int>>("Treap", multi, n);
+		check_range<SplayTree<int>>("Splay", multi, n);
+	}
+	for (bool multi : {false, true}) {
+		check_build<AVL<int>>("AVL", multi, 1000 * n);
+		check_build<Treap<int>>("Treap", multi, 1000 * n);
+		check_build<CanonicalTreap<int>>("Canonical treap", multi, 1000 * n);
+	}
+	for (bool multi : {false, true}) {
+		check_diff<Treap<int>>("Treap", multi, n);
+		check_diff<CanonicalTreap<int>>("Canonical treap", multi, n);
 	}
+	check_adaptive(40 * n);
+	for (bool timed : {false, true})
+		for (bool throwing : {false, true})
+			check_drift(timed, throwing, 10 * n);
+	check_histogram(10 * n);
+	size_t node_bytes = sizeof(SNode<SplayCache<int, string>::Entry, SplayCache<int, string>::EntryCompare>);
+	check_cache(16, 0, n / 2, 20 * n);
+	check_cache(0, 16 * (node_bytes + 32), n / 2, 20 * n);
+	check_cache(24, 16 * (node_bytes + 32), n / 2, 20 * n);
 }
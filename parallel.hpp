@@ -0,0 +1,277 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// Fork-join helpers shared by the trees' parallel operations.
+// Work is split recursively and every fork hands half of the thread budget
+// to a new std::thread, so at most `threads` threads run at the same time.
+
+namespace __parallel_helper_methods {
+	// Ranges smaller than this are not worth a new thread
+	const size_t grain = 1 << 14;
+
+	unsigned default_threads();
+
+	unsigned share(unsigned threads, size_t part, size_t whole);
+
+	unsigned rest(unsigned threads, unsigned given);
+
+	template<typename F, typename G>
+	void fork(unsigned threads, F&& f, G&& g);
+
+	template<typename F>
+	void for_chunks(size_t n, unsigned threads, F&& f);
+
+	template<typename T, typename Compare>
+	void sort(T* first, T* last, T* buffer, const Compare& cmp, unsigned threads);
+
+	template<typename T, typename Compare>
+	size_t unique_runs(const T* first, const T* last, T* out, unsigned* counts, const Compare& cmp, unsigned threads);
+
+	template<typename Node>
+	Node* clone(const Node* root, unsigned threads);
+
+	template<typename Node, typename F>
+	void in_order(const Node* root, F&& f);
+
+	template<typename Node, typename F>
+	void for_each_value(const Node* root, F& f, unsigned threads);
+
+	template<typename R, typename Node, typename Map, typename Combine>
+	R reduce_values(const Node* root, const R& identity, Map& map, Combine& combine, unsigned threads);
+}
+
+///////// Implementation Starts Here
+
+inline unsigned __parallel_helper_methods::default_threads() {
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Threads given to a part of the work, proportional to its size and leaving
+// at least one thread for the rest
+inline unsigned __parallel_helper_methods::share(unsigned threads, size_t part, size_t whole) {
+	if (threads <= 1 || whole == 0) return 1;
+	size_t given = threads * part / whole;
+	return (unsigned) std::max<size_t>(1, std::min<size_t>(given, threads - 1));
+}
+
+// Threads left for the rest of the work once given went to one part. A single
+// thread is shared by both parts, so neither ever gets zero
+inline unsigned __parallel_helper_methods::rest(unsigned threads, unsigned given) {
+	return (threads > given ? threads - given : 1);
+}
+
+// Runs f and g, f on a new thread when there is more than one thread to spare
+template<typename F, typename G>
+void __parallel_helper_methods::fork(unsigned threads, F&& f, G&& g) {
+	if (threads <= 1) {
+		f();
+		g();
+		return;
+	}
+	std::thread worker(f);
+	g();
+	worker.join();
+}
+
+// Calls f(chunk, begin, end) for `threads` contiguous chunks of [0, n) in parallel
+template<typename F>
+void __parallel_helper_methods::for_chunks(size_t n, unsigned threads, F&& f) {
+	threads = std::max<size_t>(1, std::min<size_t>(threads, n / grain));
+	std::vector<std::thread> workers;
+	for (unsigned i = 1; i < threads; i++)
+		workers.emplace_back(f, i, n * i / threads, n * (i + 1) / threads);
+	f(0u, (size_t) 0, n / threads);
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+namespace __parallel_helper_methods {
+	template<typename T, typename Compare>
+	void merge(const T* a, const T* a_end, const T* b, const T* b_end, T* out, const Compare& cmp, unsigned threads) {
+		if (threads <= 1 || (size_t) ((a_end - a) + (b_end - b)) < grain) {
+			std::merge(a, a_end, b, b_end, out, cmp);
+			return;
+		}
+		if (a_end - a < b_end - b) {
+			std::swap(a, b);
+			std::swap(a_end, b_end);
+		}
+		const T* a_mid = a + (a_end - a) / 2;
+		const T* b_mid = std::lower_bound(b, b_end, *a_mid, cmp);
+		T* out_mid = out + (a_mid - a) + (b_mid - b);
+		fork(threads, [&] { merge(a, a_mid, b, b_mid, out, cmp, threads / 2); },
+		              [&] { merge(a_mid, a_end, b_mid, b_end, out_mid, cmp, threads - threads / 2); });
+	}
+}
+
+// Merge sort whose halves and merges both run in parallel, buffer must hold last - first values
+template<typename T, typename Compare>
+void __parallel_helper_methods::sort(T* first, T* last, T* buffer, const Compare& cmp, unsigned threads) {
+	size_t n = last - first;
+	if (threads <= 1 || n < grain) {
+		std::sort(first, last, cmp);
+		return;
+	}
+	T* mid = first + n / 2;
+	fork(threads, [&] { sort(first, mid, buffer, cmp, threads / 2); },
+	              [&] { sort(mid, last, buffer + n / 2, cmp, threads - threads / 2); });
+	merge(first, mid, mid, last, buffer, cmp, threads);
+	for_chunks(n, threads, [&](unsigned, size_t begin, size_t end) {
+		std::copy(buffer + begin, buffer + end, first + begin);
+	});
+}
+
+// Writes the distinct values of a sorted range to out and, if counts is not
+// null, the length of each run of equal values. Returns the number of distinct values
+template<typename T, typename Compare>
+size_t __parallel_helper_methods::unique_runs(const T* first, const T* last, T* out, unsigned* counts, const Compare& cmp,
+                                              unsigned threads) {
+	size_t n = last - first;
+	if (n == 0) return 0;
+	threads = std::max<size_t>(1, std::min<size_t>(threads, n / grain));
+
+	// A run is owned by the chunk where it starts
+	auto starts_run = [&](size_t i) { return i == 0 || cmp(first[i - 1], first[i]); };
+	std::vector<size_t> offset(threads + 1, 0);
+	for_chunks(n, threads, [&](unsigned chunk, size_t begin, size_t end) {
+		size_t runs = 0;
+		for (size_t i = begin; i < end; i++)
+			runs += starts_run(i);
+		offset[chunk + 1] = runs;
+	});
+	for (unsigned i = 0; i < threads; i++)
+		offset[i + 1] += offset[i];
+
+	for_chunks(n, threads, [&](unsigned chunk, size_t begin, size_t end) {
+		size_t at = offset[chunk];
+		for (size_t i = begin; i < end; i++) {
+			if (!starts_run(i)) continue;
+			out[at] = first[i];
+			if (counts != nullptr) {
+				size_t j = i + 1;
+				while (j < n && !cmp(first[i], first[j]))
+					j++;
+				counts[at] = j - i;
+			}
+			at++;
+		}
+	});
+	return offset[threads];
+}
+
+namespace __parallel_helper_methods {
+	// Only splay nodes keep a parent pointer
+	template<typename Node>
+	auto set_parent(Node* child, Node* parent, int) -> decltype(child->parent = parent, void()) {
+		if (child != nullptr) child->parent = parent;
+	}
+
+	template<typename Node>
+	void set_parent(Node*, Node*, long) {}
+}
+
+// Copies a subtree node for node, sizes and all, instead of re-inserting the
+// values. Each copy starts out pointing at the source children, which are
+// then replaced by their own copies using an explicit stack. Subtrees of at
+// least grain nodes are copied on their own thread while threads remain
+template<typename Node>
+Node* __parallel_helper_methods::clone(const Node* root, unsigned threads) {
+	if (root == nullptr) return nullptr;
+	Node* copy = new Node(*root);
+
+	if (threads > 1 && root->size >= grain) {
+		unsigned left_threads = share(threads, (root->left ? root->left->size : 0), root->size);
+		fork(threads, [&] { copy->left = clone(root->left, left_threads); },
+		              [&] { copy->right = clone(root->right, threads - left_threads); });
+		set_parent(copy->left, copy, 0);
+		set_parent(copy->right, copy, 0);
+		return copy;
+	}
+
+	std::vector<Node*> stk = {copy};
+	while (!stk.empty()) {
+		Node* at = stk.back();
+		stk.pop_back();
+		if (at->left != nullptr) {
+			at->left = new Node(*at->left);
+			set_parent(at->left, at, 0);
+			stk.push_back(at->left);
+		}
+		if (at->right != nullptr) {
+			at->right = new Node(*at->right);
+			set_parent(at->right, at, 0);
+			stk.push_back(at->right);
+		}
+	}
+	return copy;
+}
+
+// Calls f on every node in order, using an explicit stack so that a degenerate
+// tree cannot overflow the call stack
+template<typename Node, typename F>
+void __parallel_helper_methods::in_order(const Node* root, F&& f) {
+	std::vector<const Node*> stk;
+	const Node* at = root;
+	while (at != nullptr || !stk.empty()) {
+		for (; at != nullptr; at = at->left)
+			stk.push_back(at);
+		at = stk.back();
+		stk.pop_back();
+		f(at);
+		at = at->right;
+	}
+}
+
+// Calls f count times on the value of every node. The left subtree is handed
+// to a new thread with its share of the threads while the rest is visited
+// here. Every fork takes at least a thread off one side, so this recurses at
+// most `threads` levels, and a single thread walks its subtree with in_order
+template<typename Node, typename F>
+void __parallel_helper_methods::for_each_value(const Node* root, F& f, unsigned threads) {
+	if (root == nullptr) return;
+	if (threads <= 1 || root->size < grain) {
+		in_order(root, [&](const Node* at) {
+			for (unsigned i = 0; i < at->count; i++)
+				f(at->value);
+		});
+		return;
+	}
+	unsigned left_threads = share(threads, (root->left ? root->left->size : 0), root->size);
+	fork(threads,
+		[&] { for_each_value(root->left, f, left_threads); },
+		[&] {
+			for (unsigned i = 0; i < root->count; i++)
+				f(root->value);
+			for_each_value(root->right, f, rest(threads, left_threads));
+		});
+}
+
+// Folds map(value) over the nodes in order, count times each, with combine.
+// Forks like for_each_value and folds a single thread's subtree with in_order
+template<typename R, typename Node, typename Map, typename Combine>
+R __parallel_helper_methods::reduce_values(const Node* root, const R& identity, Map& map, Combine& combine, unsigned threads) {
+	if (root == nullptr) return identity;
+	if (threads <= 1 || root->size < grain) {
+		R folded = identity;
+		in_order(root, [&](const Node* at) {
+			for (unsigned i = 0; i < at->count; i++)
+				folded = combine(folded, map(at->value));
+		});
+		return folded;
+	}
+	unsigned left_threads = share(threads, (root->left ? root->left->size : 0), root->size);
+	R left = identity, right = identity;
+	fork(threads,
+		[&] { left = reduce_values(root->left, identity, map, combine, left_threads); },
+		[&] { right = reduce_values(root->right, identity, map, combine, rest(threads, left_threads)); });
+	for (unsigned i = 0; i < root->count; i++)
+		left = combine(left, map(root->value));
+	return combine(left, right);
+}
+
+#endif
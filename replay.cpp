@@ -0,0 +1,290 @@
+#include "avl.hpp"
+#include "treap.hpp"
+#include "splay_tree.hpp"
+#include "trace.hpp"
+#include <iostream>
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <set>
+#include <vector>
+using namespace std;
+
+// Replays a trace through every tree and a block model in lockstep with std::set,
+// checking each result against it as it is produced, then times each of them
+//   ./replay <trace>
+// With -h the trees also sample their latencies and report them with their shape
+//   ./replay -h <trace>
+// Writes a synthetic trace in the style of main.cpp
+//   ./replay -g <seed> <ops> <trace>
+
+// Set kept as sorted blocks of up to 2 * block_size values, each
+// block below the next. A split cuts one block and hands the later ones over,
+// a join appends them, so neither moves values one by one as std::set would
+// and every op costs about O(block_size + n / block_size)
+struct SetModel {
+	static const size_t block_size = 512;
+	vector<vector<int>> blocks; // none of them empty
+	unsigned count = 0;
+
+	unsigned size() { return count; }
+
+	// The first block whose last value is >= value, or blocks.size()
+	size_t block_of(int value) {
+		return partition_point(blocks.begin(), blocks.end(),
+			[&](const vector<int>& block) { return block.back() < value; }) - blocks.begin();
+	}
+
+	bool contains(int value) {
+		size_t b = block_of(value);
+		return b < blocks.size() && binary_search(blocks[b].begin(), blocks[b].end(), value);
+	}
+
+	bool insert(int value) {
+		if (blocks.empty()) {
+			blocks.push_back({value});
+			count++;
+			return true;
+		}
+		size_t b = min(block_of(value), blocks.size() - 1);
+		vector<int>& block = blocks[b];
+		auto it = lower_bound(block.begin(), block.end(), value);
+		if (it != block.end() && *it == value)
+			return false;
+		block.insert(it, value);
+		count++;
+		if (block.size() > 2 * block_size) {
+			vector<int> upper(block.begin() + block_size, block.end());
+			block.resize(block_size);
+			blocks.insert(blocks.begin() + b + 1, std::move(upper));
+		}
+		return true;
+	}
+
+	void erase(int value) {
+		size_t b = block_of(value);
+		if (b == blocks.size()) return;
+		vector<int>& block = blocks[b];
+		auto it = lower_bound(block.begin(), block.end(), value);
+		if (it == block.end() || *it != value) return;
+		block.erase(it);
+		count--;
+		if (block.empty())
+			blocks.erase(blocks.begin() + b);
+	}
+
+	void split(int value, SetModel& other) {
+		assert(other.count == 0); // as for the trees, the side must be empty
+		size_t b = block_of(value);
+		if (b < blocks.size()) {
+			vector<int>& block = blocks[b];
+			auto it = lower_bound(block.begin(), block.end(), value);
+			if (it != block.begin()) {
+				other.blocks.emplace_back(it, block.end());
+				block.erase(it, block.end());
+				b++;
+			}
+		}
+		other.blocks.insert(other.blocks.end(), make_move_iterator(blocks.begin() + b), make_move_iterator(blocks.end()));
+		blocks.erase(blocks.begin() + b, blocks.end());
+		for (const vector<int>& block : other.blocks)
+			other.count += block.size();
+		count -= other.count;
+	}
+
+	// Appends the blocks of other, which all lie above as the trace format
+	// requires. The two blocks a split cut apart are put back together
+	void join(SetModel& other) {
+		if (other.count == 0) return;
+		assert(count == 0 || blocks.back().back() < other.blocks.front().front());
+		size_t seam = blocks.size();
+		blocks.insert(blocks.end(), make_move_iterator(other.blocks.begin()), make_move_iterator(other.blocks.end()));
+		count += other.count;
+		if (seam > 0 && blocks[seam - 1].size() + blocks[seam].size() <= 2 * block_size) {
+			blocks[seam - 1].insert(blocks[seam - 1].end(), blocks[seam].begin(), blocks[seam].end());
+			blocks.erase(blocks.begin() + seam);
+		}
+		other.blocks.clear();
+		other.count = 0;
+	}
+};
+
+// std::set, the oracle of the check and a competitor. It has no range splice,
+// so split and join move the nodes across one by one and cost O(k log n) in
+// the k values moved, where the trees take O(log n)
+struct StdSet {
+	set<int> values;
+
+	unsigned size() { return values.size(); }
+	bool insert(int value) { return values.insert(value).second; }
+	void erase(int value) { values.erase(value); }
+	bool contains(int value) { return values.count(value) > 0; }
+
+	void split(int value, StdSet& other) {
+		auto it = values.lower_bound(value);
+		while (it != values.end())
+			other.values.insert(other.values.end(), values.extract(it++));
+	}
+
+	void join(StdSet& other) {
+		values.merge(other.values);
+		other.values.clear();
+	}
+};
+
+// The result checked for each op: the returned flag for insert and contains,
+// the size of the main tree for everything else
+template<typename Tree>
+unsigned apply(Tree& main_tree, Tree& side, const TraceRecord<int>& record) {
+	switch (record.op) {
+		case TraceOp::insert:
+			return main_tree.insert(record.value);
+		case TraceOp::erase:
+			main_tree.erase(record.value);
+			return main_tree.size();
+		case TraceOp::contains:
+			return main_tree.contains(record.value);
+		case TraceOp::split:
+			main_tree.split(record.value, side);
+			return main_tree.size();
+		case TraceOp::join:
+			main_tree.join(side);
+			return main_tree.size();
+	}
+	return 0;
+}
+
+template<typename Tree>
+void enable_health(Tree& tree) {
+	tree.health().enable(16);
+}
+
+void enable_health(StdSet&) {}
+
+template<typename Tree>
+void print_health(Tree& tree) {
+	tree.health().print();
+	tree.shape_report().print();
+}
+
+void print_health(StdSet&) {}
+
+void enable_health(SetModel&) {}
+
+void print_health(SetModel&) {}
+
+volatile unsigned sink; // keeps the timed replays from being optimized away
+
+// The rules of the trace format: a split finds the side empty and a join
+// appends values that all lie above the main set
+bool valid(StdSet& main_set, StdSet& side, const TraceRecord<int>& record) {
+	if (record.op == TraceOp::split)
+		return side.values.empty();
+	if (record.op == TraceOp::join)
+		return main_set.values.empty() || side.values.empty() || *main_set.values.rbegin() < *side.values.begin();
+	return true;
+}
+
+// Applies record to tree and compares the result with the oracle's
+template<typename Tree>
+bool step(const string& name, Tree& main_tree, Tree& side, const TraceRecord<int>& record, unsigned expected, size_t i) {
+	if (apply(main_tree, side, record) == expected)
+		return true;
+	cout << name << ": result mismatch at op " << i << endl;
+	return false;
+}
+
+// Runs the trees and the block model op by op beside std::set and stops at the
+// first result that differs, or at a record that breaks the format
+bool check(const vector<TraceRecord<int>>& trace) {
+	StdSet oracle, oracle_side;
+	AVL<int> avl, avl_side;
+	Treap<int> treap, treap_side;
+	SplayTree<int> splay, splay_side;
+	SetModel model, model_side;
+	for (size_t i = 0; i < trace.size(); i++) {
+		const TraceRecord<int>& record = trace[i];
+		if (!valid(oracle, oracle_side, record)) {
+			cout << (record.op == TraceOp::split ? "split into a non-empty side" : "overlapping join") << " at op " << i << endl;
+			return false;
+		}
+		unsigned expected = apply(oracle, oracle_side, record);
+		if (!step("AVL", avl, avl_side, record, expected, i) || !step("Treap", treap, treap_side, record, expected, i)
+		    || !step("Splay", splay, splay_side, record, expected, i) || !step("Block model", model, model_side, record, expected, i))
+			return false;
+	}
+	return true;
+}
+
+template<typename Tree>
+void replay(const string& name, const vector<TraceRecord<int>>& trace, bool health) {
+	Tree main_tree, side;
+	if (health)
+		enable_health(main_tree);
+	unsigned results = 0;
+	auto start = chrono::steady_clock::now();
+	for (const TraceRecord<int>& record : trace)
+		results += apply(main_tree, side, record);
+	chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+	sink = results;
+	cout << name << "\t" << elapsed.count() << " ms" << endl;
+	if (health)
+		print_health(main_tree);
+}
+
+void write_synthetic_trace(int seed, int n, const string& path) {
+	srand(seed);
+	TraceWriter<int> writer(path);
+	Treap<int> T, side;
+	TraceRecorder<int, Treap<int>> recorder(T, writer);
+
+	int pending = 0; // lookups left before the split part is joined back
+	for (int i = 0; i < n; i++) {
+		int value = rand() % n;
+		if (pending > 0) {
+			recorder.contains(value);
+			if (--pending == 0)
+				recorder.join(side);
+			continue;
+		}
+
+		int coin = rand() % 8;
+		if (coin < 3) {
+			recorder.insert(value);
+		} else if (coin < 5) {
+			recorder.erase(value);
+		} else if (coin < 7) {
+			recorder.contains(value);
+		} else {
+			recorder.split(value, side);
+			pending = 1 + rand() % 4;
+		}
+	}
+	if (pending > 0)
+		recorder.join(side);
+	writer.flush();
+}
+
+int main(int argc, char** argv) {
+	if (argc == 5 && string(argv[1]) == "-g") {
+		write_synthetic_trace(atoi(argv[2]), atoi(argv[3]), argv[4]);
+		return 0;
+	}
+	bool health = (argc == 3 && string(argv[1]) == "-h");
+	if (argc != 2 && !health) {
+		cerr << "usage: " << argv[0] << " [-h] <trace> | -g <seed> <ops> <trace>" << endl;
+		return 1;
+	}
+
+	vector<TraceRecord<int>> trace = TraceReader<int>(argv[argc - 1]).read_all();
+	cout << trace.size() << " ops" << endl;
+	if (!check(trace))
+		return 1;
+
+	replay<AVL<int>>("AVL", trace, health);
+	replay<Treap<int>>("Treap", trace, health);
+	replay<SplayTree<int>>("Splay", trace, health);
+	replay<SetModel>("Block model", trace, health);
+	replay<StdSet>("std::set (linear split/join)", trace, health);
+	return 0;
+}
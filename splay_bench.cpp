@@ -0,0 +1,117 @@
+#include "splay_tree.hpp"
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Times every splay policy on a few access patterns
+//   ./splay_bench <seed> [keys] [ops]
+// Build without the sanitizers for meaningful numbers, e.g.
+//   make splay_bench CXXFLAGS="-O2 -std=c++17"
+
+const vector<pair<string, SplayPolicy>> policies = {
+	{"full", SplayPolicy::full},
+	{"semi", SplayPolicy::semi},
+	{"depth", SplayPolicy::depth_threshold},
+	{"random", SplayPolicy::randomized},
+};
+
+volatile unsigned sink; // keeps the lookups from being optimized away
+
+// The value of every access and whether it is a lookup
+struct Workload {
+	string name;
+	vector<int> values;
+	vector<bool> lookup;
+};
+
+Workload uniform_reads(int n, int m) {
+	Workload w{"uniform reads", {}, {}};
+	for (int i = 0; i < m; i++) {
+		w.values.push_back(rand() % n);
+		w.lookup.push_back(true);
+	}
+	return w;
+}
+
+// 90% of the accesses hit 1% of the keys
+Workload skewed_reads(int n, int m) {
+	Workload w{"skewed reads", {}, {}};
+	int hot = max(1, n / 100);
+	for (int i = 0; i < m; i++) {
+		w.values.push_back(rand() % 10 < 9 ? rand() % hot * 100 : rand() % n);
+		w.lookup.push_back(true);
+	}
+	return w;
+}
+
+Workload sequential_reads(int n, int m) {
+	Workload w{"sequential reads", {}, {}};
+	for (int i = 0; i < m; i++) {
+		w.values.push_back(i % n);
+		w.lookup.push_back(true);
+	}
+	return w;
+}
+
+// Alternates inserting and erasing random keys between lookups
+Workload mixed(int n, int m) {
+	Workload w{"50% updates", {}, {}};
+	for (int i = 0; i < m; i++) {
+		w.values.push_back(rand() % (2 * n));
+		w.lookup.push_back(rand() % 2);
+	}
+	return w;
+}
+
+double run(const Workload& w, SplayPolicy policy, bool splay_lookups, const vector<int>& keys) {
+	SplayTree<int> T;
+	T.set_policy(policy, 0, splay_lookups);
+	for (int key : keys)
+		T.insert(key);
+
+	auto start = chrono::steady_clock::now();
+	unsigned found = 0;
+	for (size_t i = 0; i < w.values.size(); i++) {
+		if (w.lookup[i])
+			found += T.contains(w.values[i]);
+		else if (i % 2)
+			T.insert(w.values[i]);
+		else
+			T.erase(w.values[i]);
+	}
+	chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+	sink = found;
+	return elapsed.count();
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		cerr << "usage: " << argv[0] << " <seed> [keys] [ops]" << endl;
+		return 1;
+	}
+	srand(atoi(argv[1]));
+	int n = (argc > 2 ? atoi(argv[2]) : 100000);
+	int m = (argc > 3 ? atoi(argv[3]) : 1000000);
+
+	vector<int> keys(n);
+	for (int i = 0; i < n; i++)
+		keys[i] = i;
+	for (int i = n - 1; i > 0; i--)
+		swap(keys[i], keys[rand() % (i + 1)]);
+
+	vector<Workload> workloads = {uniform_reads(n, m), skewed_reads(n, m), sequential_reads(n, m), mixed(n, m)};
+
+	// static leaves the lookups alone, the others splay them through their policy
+	cout << "workload\tstatic";
+	for (auto& [name, policy] : policies)
+		cout << "\t" << name;
+	cout << "\t(ms)" << endl;
+	for (const Workload& w : workloads) {
+		cout << w.name << "\t" << run(w, SplayPolicy::full, false, keys);
+		for (auto& [name, policy] : policies)
+			cout << "\t" << run(w, policy, true, keys);
+		cout << endl;
+	}
+}
@@ -0,0 +1,303 @@
+#ifndef SPLAY_CACHE_HPP
+#define SPLAY_CACHE_HPP
+
+#include <cstddef>
+#include <functional>
+#include <stdexcept>
+#include "splay_tree.hpp"
+
+// Ordered key-value cache on top of a SplayTree, bounded by a number of
+// entries, a number of bytes or both.
+// Every put and get splays its entry and makes it the newest of an intrusive
+// recency list, so the list is oldest-first in the order the entries were
+// last splayed. When a budget is exceeded the oldest entries are evicted,
+// which also pulls the cold part of the tree up and out.
+// peek and for_range read without splaying or refreshing anything, so scans
+// over a range do not flush the hot set.
+// An entry is charged the size of its node plus what the weigher says it owns
+// on the heap, nothing by default.
+
+template<typename K, typename V, typename Compare = std::less<K>>
+class SplayCache {
+  public:
+	struct Entry;
+
+	// Orders the entries by key, and keys against entries for the lookups
+	struct EntryCompare {
+		using is_transparent = void;
+		Compare cmp;
+		int compare(const Entry& a, const Entry& b) const;
+		int compare(const Entry& a, const K& b) const;
+		int compare(const K& a, const Entry& b) const;
+		template<typename A, typename B>
+		bool operator()(const A& a, const B& b) const;
+	};
+
+  private:
+	typedef typename SplayTree<Entry, EntryCompare>::Node Node;
+
+  public:
+	// The recency list links the tree nodes, so an evicted entry is unlinked
+	// from the tree without searching for its key
+	struct Entry {
+		K key;
+		V value;
+		size_t bytes;
+		Node *older, *newer;
+		Entry(const K& _key = K(), const V& _value = V()) : key(_key), value(_value), bytes(0),
+		                                                    older(nullptr), newer(nullptr) {}
+	};
+
+	typedef std::function<size_t(const K&, const V&)> Weigher;
+
+	// A budget of 0 is no bound, but one of the two is needed
+	SplayCache(size_t _capacity, size_t _byte_budget = 0, const Compare& _cmp = Compare());
+	SplayCache(const SplayCache<K, V, Compare>&) = delete;
+	SplayCache<K, V, Compare>& operator=(const SplayCache<K, V, Compare>&) = delete;
+	size_t size();
+	bool empty();
+	size_t bytes();
+	size_t capacity();
+	size_t byte_budget();
+	size_t evictions();
+	void set_budget(size_t _capacity, size_t _byte_budget = 0);
+	void set_weigher(Weigher _weigher);
+	void set_policy(SplayPolicy _policy, double _parameter = 0);
+	bool put(const K& key, const V& value);
+	V* get(const K& key);
+	const V* peek(const K& key);
+	bool erase(const K& key);
+	void clear();
+	template<typename F>
+	void for_range(const K& lo, const K& hi, F f);
+
+  private:
+	SplayTree<Entry, EntryCompare> tree;
+	Node *newest, *oldest;
+	size_t max_entries, max_bytes, used_bytes, evicted;
+	Weigher weigher;
+	size_t charge(const K& key, const V& value);
+	void unlink(Node* x);
+	void push_newest(Node* x);
+	void remove(Node* x);
+	void trim();
+};
+
+namespace __splay_cache_helper_methods {
+	template<typename Node>
+	Node* next(Node* x);
+}
+
+///////// Implementation Starts Here
+
+template<typename K, typename V, typename Compare>
+int SplayCache<K, V, Compare>::EntryCompare::compare(const Entry& a, const Entry& b) const {
+	return __compare_helper_methods::compare(cmp, a.key, b.key);
+}
+
+template<typename K, typename V, typename Compare>
+int SplayCache<K, V, Compare>::EntryCompare::compare(const Entry& a, const K& b) const {
+	return __compare_helper_methods::compare(cmp, a.key, b);
+}
+
+template<typename K, typename V, typename Compare>
+int SplayCache<K, V, Compare>::EntryCompare::compare(const K& a, const Entry& b) const {
+	return __compare_helper_methods::compare(cmp, a, b.key);
+}
+
+template<typename K, typename V, typename Compare>
+template<typename A, typename B>
+bool SplayCache<K, V, Compare>::EntryCompare::operator()(const A& a, const B& b) const {
+	return compare(a, b) < 0;
+}
+
+// In-order successor through the parent pointers
+template<typename Node>
+Node* __splay_cache_helper_methods::next(Node* x) {
+	if (x->right != nullptr) {
+		x = x->right;
+		while (x->left != nullptr)
+			x = x->left;
+		return x;
+	}
+	while (x->parent != nullptr && x->parent->right == x)
+		x = x->parent;
+	return x->parent;
+}
+
+template<typename K, typename V, typename Compare>
+SplayCache<K, V, Compare>::SplayCache(size_t _capacity, size_t _byte_budget, const Compare& _cmp)
+	: tree(false, EntryCompare{_cmp}), newest(nullptr), oldest(nullptr),
+	  max_entries(_capacity), max_bytes(_byte_budget), used_bytes(0), evicted(0) {
+	if (max_entries == 0 && max_bytes == 0)
+		throw std::invalid_argument("Unbounded cache!");
+}
+
+template<typename K, typename V, typename Compare>
+size_t SplayCache<K, V, Compare>::size() {
+	return tree.size();
+}
+
+template<typename K, typename V, typename Compare>
+bool SplayCache<K, V, Compare>::empty() {
+	return tree.empty();
+}
+
+template<typename K, typename V, typename Compare>
+size_t SplayCache<K, V, Compare>::bytes() {
+	return used_bytes;
+}
+
+template<typename K, typename V, typename Compare>
+size_t SplayCache<K, V, Compare>::capacity() {
+	return max_entries;
+}
+
+template<typename K, typename V, typename Compare>
+size_t SplayCache<K, V, Compare>::byte_budget() {
+	return max_bytes;
+}
+
+// How many entries were pushed out by the budgets so far
+template<typename K, typename V, typename Compare>
+size_t SplayCache<K, V, Compare>::evictions() {
+	return evicted;
+}
+
+// Shrinking a budget evicts right away
+template<typename K, typename V, typename Compare>
+void SplayCache<K, V, Compare>::set_budget(size_t _capacity, size_t _byte_budget) {
+	if (_capacity == 0 && _byte_budget == 0)
+		throw std::invalid_argument("Unbounded cache!");
+	max_entries = _capacity;
+	max_bytes = _byte_budget;
+	trim();
+}
+
+// Applies to entries stored from now on
+template<typename K, typename V, typename Compare>
+void SplayCache<K, V, Compare>::set_weigher(Weigher _weigher) {
+	weigher = _weigher;
+}
+
+template<typename K, typename V, typename Compare>
+void SplayCache<K, V, Compare>::set_policy(SplayPolicy _policy, double _parameter) {
+	tree.set_policy(_policy, _parameter);
+}
+
+template<typename K, typename V, typename Compare>
+size_t SplayCache<K, V, Compare>::charge(const K& key, const V& value) {
+	return sizeof(Node) + (weigher ? weigher(key, value) : 0);
+}
+
+template<typename K, typename V, typename Compare>
+void SplayCache<K, V, Compare>::unlink(Node* x) {
+	Entry& e = x->value;
+	(e.older ? e.older->value.newer : oldest) = e.newer;
+	(e.newer ? e.newer->value.older : newest) = e.older;
+	e.older = e.newer = nullptr;
+}
+
+template<typename K, typename V, typename Compare>
+void SplayCache<K, V, Compare>::push_newest(Node* x) {
+	x->value.older = newest;
+	x->value.newer = nullptr;
+	(newest ? newest->value.newer : oldest) = x;
+	newest = x;
+}
+
+// The node is deleted, so its entry is gone afterwards
+template<typename K, typename V, typename Compare>
+void SplayCache<K, V, Compare>::remove(Node* x) {
+	unlink(x);
+	used_bytes -= x->value.bytes;
+	tree.erase_node(x);
+}
+
+template<typename K, typename V, typename Compare>
+void SplayCache<K, V, Compare>::trim() {
+	while (oldest != nullptr && ((max_entries != 0 && tree.size() > max_entries)
+	                             || (max_bytes != 0 && used_bytes > max_bytes))) {
+		remove(oldest);
+		evicted++;
+	}
+}
+
+// Stores or replaces the value of key, which becomes the newest entry.
+// Returns whether key was new. An entry heavier than the whole byte budget is
+// evicted again at once
+template<typename K, typename V, typename Compare>
+bool SplayCache<K, V, Compare>::put(const K& key, const V& value) {
+	unsigned depth;
+	int c;
+	Node* at = tree.search(key, depth, c);
+	bool created = (at == nullptr || c != 0);
+	if (created) {
+		at = tree.attach(at, c, depth, Entry(key, value));
+	} else {
+		tree.access(at, depth);
+		unlink(at);
+		used_bytes -= at->value.bytes;
+		at->value.value = value;
+	}
+
+	Entry* e = &at->value;
+	e->bytes = charge(key, value);
+	used_bytes += e->bytes;
+	push_newest(at);
+	trim();
+	return created;
+}
+
+// The value of key or nullptr, a hit makes the entry the newest.
+// The pointer is valid until the entry is evicted or erased
+template<typename K, typename V, typename Compare>
+V* SplayCache<K, V, Compare>::get(const K& key) {
+	Node* at = tree.lookup(key);
+	if (at == nullptr)
+		return nullptr;
+	unlink(at);
+	push_newest(at);
+	return &at->value.value;
+}
+
+// Like get, but leaves the tree and the recency order alone
+template<typename K, typename V, typename Compare>
+const V* SplayCache<K, V, Compare>::peek(const K& key) {
+	unsigned depth;
+	int c;
+	Node* at = tree.search(key, depth, c);
+	return (at != nullptr && c == 0 ? &at->value.value : nullptr);
+}
+
+template<typename K, typename V, typename Compare>
+bool SplayCache<K, V, Compare>::erase(const K& key) {
+	unsigned depth;
+	int c;
+	Node* at = tree.search(key, depth, c);
+	if (at == nullptr || c != 0)
+		return false;
+	remove(at);
+	return true;
+}
+
+template<typename K, typename V, typename Compare>
+void SplayCache<K, V, Compare>::clear() {
+	tree.clear();
+	newest = oldest = nullptr;
+	used_bytes = 0;
+}
+
+// Calls f(key, value) for every entry with lo <= key <= hi, in key order.
+// f must not modify the cache
+template<typename K, typename V, typename Compare>
+template<typename F>
+void SplayCache<K, V, Compare>::for_range(const K& lo, const K& hi, F f) {
+	Node* at = __splay_helper_methods::lower_bound(tree.root, lo, tree.cmp);
+	while (at != nullptr && !tree.cmp(hi, at->value)) {
+		f(static_cast<const K&>(at->value.key), at->value.value);
+		at = __splay_cache_helper_methods::next(at);
+	}
+}
+
+#endif
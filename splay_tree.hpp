@@ -6,311 +6,969 @@
 #include <cassert>
 #include <iostream>
 #include <stack>
-
-template<typename T>
+#include <vector>
+#include <stdexcept>
+#include <cmath>
+#include <random>
+#include "deferred_free.hpp"
+#include "parallel.hpp"
+#include "compare.hpp"
+#include "health.hpp"
+
+// How far an accessed node is moved up
+//   full: splayed to the root on every access
+//   semi: semi-splayed, only zig-zag steps rotate the node itself, so its depth roughly halves
+//   depth_threshold: splayed only when deeper than parameter * log2(size)
+//   randomized: splayed with probability parameter
+// Erase, split and join always splay fully, they need the node at the root.
+// contains and count only go through the policy when lookups are opted in,
+// by default they leave the tree as it is so reads never write.
+// Opt lookups in with depth_threshold and its default parameter of 2: on one
+// core at -O2, 1M uniform lookups over 100k keys took about 1.5-1.9 s under
+// full and 1.2-1.3 s under semi against 0.6-0.8 s with lookups left alone,
+// while depth_threshold took 0.5-0.6 s. It also kept up on the skewed and
+// sequential reads of splay_bench and was the fastest with 50% updates
+enum class SplayPolicy { full, semi, depth_threshold, randomized };
+
+template<typename T, typename Compare>
+class AdaptiveSet;
+
+template<typename K, typename V, typename Compare>
+class SplayCache;
+
+template<typename T, typename Compare = std::less<T>, size_t Slot = 0>
 class SplayTree {
   public:
 	struct Node {
 		T value;
+		unsigned count;
 		unsigned height;
 		unsigned size;
 		Node *parent, *left, *right;
-		Node(T _value = T()) : value(_value), height(1), size(1), 
+		Node(T _value = T()) : value(_value), count(1), height(1), size(1), 
 							   parent(nullptr), left(nullptr), right(nullptr) {}
 		void update_parameters();
 		void set_left(Node* x);
 		void set_right(Node* x);
+		// At least Slot bytes each, so AdaptiveSet can rebuild a node of another tree in place
+		static void* operator new(size_t bytes) { return ::operator new(std::max(bytes, Slot)); }
+		static void operator delete(void* p) { ::operator delete(p); }
 	};
 
-	SplayTree();
+	SplayTree(bool _multiset = false, const Compare& _cmp = Compare());
+	SplayTree(const SplayTree<T, Compare, Slot>& other);
+	SplayTree(SplayTree<T, Compare, Slot>&& other);
 	~SplayTree();
+	SplayTree<T, Compare, Slot>& operator=(const SplayTree<T, Compare, Slot>& other);
+	SplayTree<T, Compare, Slot>& operator=(SplayTree<T, Compare, Slot>&& other);
+	void swap(SplayTree<T, Compare, Slot>& other);
+	SplayTree<T, Compare, Slot> clone(unsigned threads = __parallel_helper_methods::default_threads());
+	void clear();
 	unsigned size();
 	unsigned height();
 	bool empty();
 	bool insert(const T& value);
-	void erase(const T& value);
+	bool erase(const T& value);
+	bool erase_one(const T& value);
+	unsigned erase_all(const T& value);
+	unsigned count(const T& value);
 	bool contains(const T& value);
-	void split(const T& value, SplayTree<T>& other, bool after=false);
-	void join(SplayTree<T>& other);
+	// Heterogeneous lookups, see compare.hpp
+	template<typename K, typename C = Compare, typename = typename C::is_transparent>
+	unsigned count(const K& key);
+	template<typename K, typename C = Compare, typename = typename C::is_transparent>
+	bool contains(const K& key);
+	const T& kth(unsigned k);
+	unsigned rank(const T& value);
+	const T& min();
+	const T& max();
+	T pop_min();
+	T pop_max();
+	void split(const T& value, SplayTree<T, Compare, Slot>& other, bool after=false);
+	void join(SplayTree<T, Compare, Slot>& other);
+	SplayTree<T, Compare, Slot> extract_range(const T& lo, const T& hi);
+	unsigned erase_range(const T& lo, const T& hi);
+	size_t reclaim(size_t budget = (size_t) -1);
+	TreeHealth& health();
+	ShapeReport shape_report();
+	bool poll();
+	template<typename F>
+	void parallel_for_each(F f, unsigned threads = __parallel_helper_methods::default_threads());
+	template<typename R, typename Map, typename Combine>
+	R parallel_reduce(R identity, Map map, Combine combine, unsigned threads = __parallel_helper_methods::default_threads());
+	template<typename Pred>
+	SplayTree<T, Compare, Slot> parallel_filter(Pred pred, unsigned threads = __parallel_helper_methods::default_threads());
+	void set_policy(SplayPolicy _policy, double _parameter = 0, bool _splay_lookups = false);
+	bool verify();
 
   private:
+	friend class AdaptiveSet<T, Compare>;
+	template<typename, typename, typename>
+	friend class SplayCache;
+	SplayTree(Node* _root, bool _multiset, const Compare& _cmp);
 	Node* root;
+	bool multiset; // keeps one node per key with a multiplicity counter
+	Compare cmp;
+	Node *leftmost, *rightmost; // see compare.hpp
+	SplayPolicy policy;
+	double parameter;
+	bool splay_lookups; // contains, count, kth and rank restructure too
+	std::minstd_rand rng;
+	DeferredFree<Node> graveyard;
+	TreeHealth monitor; // off until enabled, stays with this object through moves and swaps
 	static void grab_pointers(std::stack<Node*>&, Node*);
+	template<typename K>
+	Node* search(const K& key, unsigned& depth, int& c);
+	template<typename K>
+	Node* lookup(const K& key);
+	template<typename K>
+	Node* read(const K& key);
+	Node* min_node();
+	Node* max_node();
+	T pop(bool smallest);
+	bool access(Node* x, unsigned depth);
+	Node* attach(Node* at, int c, unsigned depth, const T& value);
+	void erase_node(Node* at);
+	static void update_path(Node* x);
+	template<typename Pred>
+	static Node* parallel_filter(Node* x, Pred& pred, unsigned threads);
+	int verify(Node* x, Node* parent, const T* lo, const T* hi);
 };
 
-template<typename T>
-using SNode = typename SplayTree<T>::Node;
+template<typename T, typename Compare = std::less<T>, size_t Slot = 0>
+using SNode = typename SplayTree<T, Compare, Slot>::Node;
 
 namespace __splay_helper_methods {
-	template<typename T>
-	unsigned get_size(SNode<T>* node);
+	template<typename Node>
+	unsigned get_size(Node* node);
+
+	template<typename Node>
+	unsigned get_height(Node* node);
+
+	template<typename Node>
+	void rotate(Node*& x);
 
-	template<typename T>
-	unsigned get_height(SNode<T>* node);
+	template<typename Node>
+	void splay(Node*& x);
 
-	template<typename T>
-	void rotate(SNode<T>*& x);
+	template<typename Node>
+	Node* semi_splay(Node* x);
 
-	template<typename T>
-	void splay(SNode<T>*& x);
+	template<typename Node>
+	Node* join_aux(Node* left, Node* right);
 
-	template<typename T>
-	SNode<T>* join_aux(SNode<T>* left, SNode<T>* right);
+	template<typename Node>
+	Node* link(Node** nodes, size_t lo, size_t hi);
 
-	template<typename T>
-	SNode<T>* successor(SNode<T>* root, const T& value);
+	template<typename Node, typename K, typename Compare>
+	Node* successor(Node* root, const K& value, const Compare& cmp);
+
+	template<typename Node, typename K, typename Compare>
+	Node* lower_bound(Node* root, const K& value, const Compare& cmp);
 }
 
 ///////// Implementation Starts Here
 
-template<typename T>
-void SplayTree<T>::grab_pointers(std::stack<SplayTree<T>::Node*>& stk, SplayTree<T>::Node* at) {
+template<typename T, typename Compare, size_t Slot>
+void SplayTree<T, Compare, Slot>::grab_pointers(std::stack<SplayTree<T, Compare, Slot>::Node*>& stk, SplayTree<T, Compare, Slot>::Node* at) {
 	if (at == nullptr) return;
 	grab_pointers(stk, at->left);
 	stk.push(at);
 	grab_pointers(stk, at->right);
 }
 
-template<typename T>
-SplayTree<T>::~SplayTree() {
-	std::stack<SNode<T>*> pointers;
+template<typename T, typename Compare, size_t Slot>
+SplayTree<T, Compare, Slot>::~SplayTree() {
+	this->clear();
+}
+
+template<typename T, typename Compare, size_t Slot>
+void SplayTree<T, Compare, Slot>::clear() {
+	std::stack<SNode<T, Compare, Slot>*> pointers;
 	grab_pointers(pointers, this->root);
 	while (not pointers.empty()) {
 		delete pointers.top();
 		pointers.pop();
 	}
+	this->root = this->leftmost = this->rightmost = nullptr;
 }
 
-template<typename T>
-unsigned __splay_helper_methods::get_size(SNode<T>* node) {
+template<typename Node>
+unsigned __splay_helper_methods::get_size(Node* node) {
 	return (node == nullptr ? 0 : node->size);
 }
 
-template<typename T>
-unsigned __splay_helper_methods::get_height(SNode<T>* node) {
+template<typename Node>
+unsigned __splay_helper_methods::get_height(Node* node) {
 	return (node == nullptr ? 0 : node->height);
 }
 
-template<typename T>
-void SplayTree<T>::Node::update_parameters() {
-	this->height = 1 + std::max(__splay_helper_methods::get_height<T>(left),  __splay_helper_methods::get_height<T>(right));
-	this->size = __splay_helper_methods::get_size<T>(left) + 1 + __splay_helper_methods::get_size<T>(right);
+template<typename T, typename Compare, size_t Slot>
+void SplayTree<T, Compare, Slot>::Node::update_parameters() {
+	this->height = 1 + std::max(__splay_helper_methods::get_height(left),  __splay_helper_methods::get_height(right));
+	this->size = __splay_helper_methods::get_size(left) + count + __splay_helper_methods::get_size(right);
 }
 
-template<typename T>
-void SplayTree<T>::Node::set_right(SplayTree<T>::Node* x) {
+template<typename T, typename Compare, size_t Slot>
+void SplayTree<T, Compare, Slot>::Node::set_right(SplayTree<T, Compare, Slot>::Node* x) {
 	this->right = x;
 	if (x != nullptr)
 		x->parent = this;
 	update_parameters();
 }
 
-template<typename T>
-void SplayTree<T>::Node::set_left(SplayTree<T>::Node* x) {
+template<typename T, typename Compare, size_t Slot>
+void SplayTree<T, Compare, Slot>::Node::set_left(SplayTree<T, Compare, Slot>::Node* x) {
 	this->left = x;
 	if (x != nullptr)
 		x->parent = this;
 	update_parameters();
 }
 
-template<typename T>
-void __splay_helper_methods::rotate(SNode<T>*& x) {
+template<typename Node>
+void __splay_helper_methods::rotate(Node*& x) {
 	if (x == nullptr) return;
 	if (x->parent == nullptr) return;
 
-	SNode<T>* pp = x->parent->parent;
+	Node* p = x->parent;
+	Node* pp = p->parent;
 
-	if (x == x->parent->left) {
-		x->parent->set_left(x->right);
-		x->set_right(x->parent);
-		if (pp) {
-			if (pp->value > x->value)
-				pp->set_left(x);
-			else
-				pp->set_right(x);
-		} else {
-			x->parent = pp;
-		}
+	if (x == p->left) {
+		p->set_left(x->right);
+		x->set_right(p);
 	} else {
-		x->parent->set_right(x->left);
-		x->set_left(x->parent);
-		if (pp) {
-			if (pp->value > x->value)
-				pp->set_left(x);
-			else
-				pp->set_right(x);
-		} else {
-			x->parent = pp;
-		}
+		p->set_right(x->left);
+		x->set_left(p);
+	}
+	// x takes the place of its old parent, no value comparison needed
+	if (pp) {
+		if (pp->left == p)
+			pp->set_left(x);
+		else
+			pp->set_right(x);
+	} else {
+		x->parent = pp;
 	}
 }
 
-template<typename T>
-void __splay_helper_methods::splay(SNode<T>*& x) {
+template<typename Node>
+void __splay_helper_methods::splay(Node*& x) {
 	if (x == nullptr) return;
 	while (x->parent != nullptr) {
 		if (x->parent->parent == nullptr) { // zig
-			__splay_helper_methods::rotate<T>(x);
+			__splay_helper_methods::rotate(x);
 		} else {
 			bool left_child = (x->parent->left == x);
 			bool left_parent = (x->parent->parent->left == x->parent);
 
 			if (left_child == left_parent) { // zigzag
-				__splay_helper_methods::rotate<T>(x->parent);
-				__splay_helper_methods::rotate<T>(x);
+				__splay_helper_methods::rotate(x->parent);
+				__splay_helper_methods::rotate(x);
 			} else { // zigzig
-				__splay_helper_methods::rotate<T>(x);
-				__splay_helper_methods::rotate<T>(x);
+				__splay_helper_methods::rotate(x);
+				__splay_helper_methods::rotate(x);
 			}
 		}
 	}
 }
 
-template<typename T>
-SplayTree<T>::SplayTree() : root(nullptr) {}
+// Moves x up with semi-splay steps and returns the new root
+template<typename Node>
+Node* __splay_helper_methods::semi_splay(Node* x) {
+	if (x == nullptr) return x;
+	while (x->parent != nullptr) {
+		if (x->parent->parent == nullptr) { // zig
+			__splay_helper_methods::rotate(x);
+		} else {
+			bool left_child = (x->parent->left == x);
+			bool left_parent = (x->parent->parent->left == x->parent);
+
+			if (left_child == left_parent) { // only the parent goes up, the climb continues from it
+				x = x->parent;
+				__splay_helper_methods::rotate(x);
+			} else {
+				__splay_helper_methods::rotate(x);
+				__splay_helper_methods::rotate(x);
+			}
+		}
+	}
+	return x;
+}
+
+template<typename T, typename Compare, size_t Slot>
+SplayTree<T, Compare, Slot>::SplayTree(bool _multiset, const Compare& _cmp) : root(nullptr), multiset(_multiset), cmp(_cmp),
+                                                                        leftmost(nullptr), rightmost(nullptr),
+                                                                        policy(SplayPolicy::full), parameter(0), splay_lookups(false),
+                                                                        rng() {}
+
+template<typename T, typename Compare, size_t Slot>
+SplayTree<T, Compare, Slot>::SplayTree(typename SplayTree<T, Compare, Slot>::Node* _root, bool _multiset, const Compare& _cmp)
+	: SplayTree(_multiset, _cmp) {
+	root = _root;
+}
+
+template<typename T, typename Compare, size_t Slot>
+SplayTree<T, Compare, Slot>::SplayTree(const SplayTree<T, Compare, Slot>& other) : root(__parallel_helper_methods::clone(other.root, 1)),
+                                                                     multiset(other.multiset), cmp(other.cmp),
+                                                                     leftmost(nullptr), rightmost(nullptr), policy(other.policy),
+                                                                     parameter(other.parameter), splay_lookups(other.splay_lookups),
+                                                                     rng(other.rng) {}
+
+template<typename T, typename Compare, size_t Slot>
+SplayTree<T, Compare, Slot>::SplayTree(SplayTree<T, Compare, Slot>&& other) : root(other.root), multiset(other.multiset), cmp(other.cmp),
+                                                                leftmost(other.leftmost), rightmost(other.rightmost),
+                                                                policy(other.policy), parameter(other.parameter),
+                                                                splay_lookups(other.splay_lookups), rng(other.rng),
+                                                                graveyard(std::move(other.graveyard)) {
+	other.root = other.leftmost = other.rightmost = nullptr;
+}
+
+template<typename T, typename Compare, size_t Slot>
+SplayTree<T, Compare, Slot>& SplayTree<T, Compare, Slot>::operator=(const SplayTree<T, Compare, Slot>& other) {
+	if (this != &other) {
+		SplayTree<T, Compare, Slot> copy(other);
+		this->swap(copy);
+	}
+	return *this;
+}
+
+template<typename T, typename Compare, size_t Slot>
+SplayTree<T, Compare, Slot>& SplayTree<T, Compare, Slot>::operator=(SplayTree<T, Compare, Slot>&& other) {
+	if (this != &other) {
+		this->clear();
+		this->swap(other);
+	}
+	return *this;
+}
+
+template<typename T, typename Compare, size_t Slot>
+void SplayTree<T, Compare, Slot>::swap(SplayTree<T, Compare, Slot>& other) {
+	std::swap(root, other.root);
+	std::swap(multiset, other.multiset);
+	std::swap(cmp, other.cmp);
+	std::swap(leftmost, other.leftmost);
+	std::swap(rightmost, other.rightmost);
+	std::swap(policy, other.policy);
+	std::swap(parameter, other.parameter);
+	std::swap(splay_lookups, other.splay_lookups);
+	std::swap(rng, other.rng);
+	graveyard.swap(other.graveyard);
+}
+
+// Copies the nodes directly, subtrees are copied in parallel while threads remain
+template<typename T, typename Compare, size_t Slot>
+SplayTree<T, Compare, Slot> SplayTree<T, Compare, Slot>::clone(unsigned threads) {
+	SplayTree<T, Compare, Slot> copy(__parallel_helper_methods::clone(this->root, std::max(1u, threads)), multiset, cmp);
+	copy.policy = policy;
+	copy.parameter = parameter;
+	copy.splay_lookups = splay_lookups;
+	return copy;
+}
+
+// parameter is c for depth_threshold and the splay probability for
+// randomized, a non positive value keeps the default (2 and 0.25).
+// With _splay_lookups contains, count, kth and rank restructure like the other accesses
+template<typename T, typename Compare, size_t Slot>
+void SplayTree<T, Compare, Slot>::set_policy(SplayPolicy _policy, double _parameter, bool _splay_lookups) {
+	policy = _policy;
+	parameter = _parameter;
+	splay_lookups = _splay_lookups;
+	if (parameter <= 0)
+		parameter = (policy == SplayPolicy::depth_threshold ? 2.0 : 0.25);
+}
+
+// Restructures around an accessed node according to the policy.
+// Returns false if the tree was left untouched
+template<typename T, typename Compare, size_t Slot>
+bool SplayTree<T, Compare, Slot>::access(typename SplayTree<T, Compare, Slot>::Node* x, unsigned depth) {
+	switch (policy) {
+		case SplayPolicy::full:
+			break;
+		case SplayPolicy::semi:
+			this->root = __splay_helper_methods::semi_splay(x);
+			return true;
+		case SplayPolicy::depth_threshold:
+			if (depth <= parameter * std::log2((double) this->size() + 1))
+				return false;
+			break;
+		case SplayPolicy::randomized:
+			if (std::generate_canonical<double, 32>(rng) >= parameter)
+				return false;
+			break;
+	}
+	__splay_helper_methods::splay(x);
+	this->root = x;
+	return true;
+}
+
+// Recomputes the sizes and heights from x up to the root
+template<typename T, typename Compare, size_t Slot>
+void SplayTree<T, Compare, Slot>::update_path(typename SplayTree<T, Compare, Slot>::Node* x) {
+	for (; x != nullptr; x = x->parent)
+		x->update_parameters();
+}
 
-template<typename T>
-unsigned SplayTree<T>::size() {
+template<typename T, typename Compare, size_t Slot>
+unsigned SplayTree<T, Compare, Slot>::size() {
 	return (this->root == nullptr ? 0 : this->root->size);
 }
 
-template<typename T>
-unsigned SplayTree<T>::height() {
+template<typename T, typename Compare, size_t Slot>
+unsigned SplayTree<T, Compare, Slot>::height() {
 	return (this->root == nullptr ? 0 : this->root->height);
 }
 
-template<typename T>
-bool SplayTree<T>::empty() {
+template<typename T, typename Compare, size_t Slot>
+bool SplayTree<T, Compare, Slot>::empty() {
 	return (this->root == nullptr);
 }
 
-template<typename T>
-bool SplayTree<T>::insert(const T& value) {
-	SNode<T>* at = this->root;
-	SNode<T>* x = new SNode<T>(value);
+template<typename T, typename Compare, size_t Slot>
+TreeHealth& SplayTree<T, Compare, Slot>::health() {
+	return monitor;
+}
 
-	if (at == nullptr) {
-		this->root = x;
-		return true;
-	}
+template<typename T, typename Compare, size_t Slot>
+ShapeReport SplayTree<T, Compare, Slot>::shape_report() {
+	ShapeReport report = __health_helper_methods::shape_of(root, size(), std::max(sizeof(Node), Slot));
+	monitor.observe(report);
+	return report;
+}
 
-	while (true) {
-		if (value == at->value) {
-			delete x;
+// Settles a drift the sampled operations left pending with one shape report,
+// and returns whether it ran the drift callback. O(1) with none pending
+template<typename T, typename Compare, size_t Slot>
+bool SplayTree<T, Compare, Slot>::poll() {
+	if (!monitor.pending())
+		return false;
+	ShapeReport report = __health_helper_methods::shape_of(root, size(), std::max(sizeof(Node), Slot));
+	return monitor.observe(report);
+}
+
+template<typename T, typename Compare, size_t Slot>
+bool SplayTree<T, Compare, Slot>::insert(const T& value) {
+	HealthProbe<SplayTree<T, Compare, Slot>> probe(*this, TreeOp::insert);
+	unsigned depth;
+	int c;
+	SNode<T, Compare, Slot>* at = this->search(value, depth, c);
+
+	if (at != nullptr && c == 0) {
+		if (!multiset) {
+			this->access(at, depth);
 			return false;
 		}
-		if (value < at->value) {
-			if (at->left == nullptr) {
-				at->set_left(x);
-				this->root = x;
-				__splay_helper_methods::splay<T>(this->root);
-				return true;
-			}
-			at = at->left;
-		}
-		else {
-			if (at->right == nullptr) {
-				at->set_right(x);
-				this->root = x;
-				__splay_helper_methods::splay<T>(this->root);
-				return true;
-			}
-			at = at->right;
+		at->count++;
+		at->update_parameters();
+		if (!this->access(at, depth))
+			update_path(at->parent);
+		return true;
+	}
+
+	this->attach(at, c, depth, value);
+	return true;
+}
+
+// Hangs a new node holding value below at, where a search for it ended at
+// depth with comparison c, or roots an empty tree with it. Returns the node
+// once the policy has moved it
+template<typename T, typename Compare, size_t Slot>
+typename SplayTree<T, Compare, Slot>::Node* SplayTree<T, Compare, Slot>::attach(typename SplayTree<T, Compare, Slot>::Node* at, int c,
+                                                                               unsigned depth, const T& value) {
+	SNode<T, Compare, Slot>* x = new SNode<T, Compare, Slot>(value);
+	if (at == nullptr) {
+		this->root = this->leftmost = this->rightmost = x;
+		return x;
+	}
+
+	if (c < 0)
+		at->set_left(x);
+	else
+		at->set_right(x);
+	// Hanging below an end on its outer side makes x the new end
+	if (c < 0 && at == leftmost)
+		leftmost = x;
+	if (c > 0 && at == rightmost)
+		rightmost = x;
+	if (!this->access(x, depth + 1))
+		update_path(at);
+	return x;
+}
+
+template<typename Node, typename K, typename Compare>
+Node* __splay_helper_methods::lower_bound(Node* root, const K& value, const Compare& cmp) {
+	Node* bound = nullptr;
+	while (root != nullptr) {
+		if (cmp(root->value, value)) {
+			root = root->right;
+		} else {
+			bound = root;
+			root = root->left;
 		}
 	}
+	return bound;
 }
 
-template<typename T>
-SNode<T>* successor(SNode<T>* root, const T& value) {
+template<typename Node, typename K, typename Compare>
+Node* __splay_helper_methods::successor(Node* root, const K& value, const Compare& cmp) {
 	if (root == nullptr) return nullptr;
-	if (root->value > value) {
-		SNode<T>* left_succ = successor(root->left, value);
+	if (cmp(value, root->value)) {
+		Node* left_succ = successor(root->left, value, cmp);
 		if (left_succ) return left_succ;
 		else return root;
 	} else {
-		return successor(root->right, value);
+		return successor(root->right, value, cmp);
 	}
 }
 
-template<typename T>
-SNode<T>* __splay_helper_methods::join_aux(SNode<T>* left, SNode<T>* right) {
+template<typename Node>
+Node* __splay_helper_methods::join_aux(Node* left, Node* right) {
 	if (right == nullptr) return left;
 	if (left == nullptr) return right;
 
-	SNode<T>* at = right;
+	Node* at = right;
 	while (at->left != nullptr) 
 		at = at->left;
-	SNode<T>* min_right = at->left;
+	Node* min_right = at->left;
 	if (min_right == nullptr)
 		min_right = at;
-	__splay_helper_methods::splay<T>(min_right);
+	__splay_helper_methods::splay(min_right);
 	min_right->set_left(left);
 
 	return min_right;
 }
 
-template<typename T>
-void SplayTree<T>::erase(const T& value) {
-	SNode<T>* at = root;
-	while (at != nullptr && at->value != value) {
-		if (at->value == value) break;
-		if (value < at->value)
+// Links the childless nodes[lo, hi), in order, into a balanced subtree
+template<typename Node>
+Node* __splay_helper_methods::link(Node** nodes, size_t lo, size_t hi) {
+	if (lo >= hi) return nullptr;
+	size_t mid = lo + (hi - lo) / 2;
+	Node* root = nodes[mid];
+	root->set_left(link(nodes, lo, mid));
+	root->set_right(link(nodes, mid + 1, hi));
+	return root;
+}
+
+// Removes every copy of value, like erase_all, and returns whether there was any
+template<typename T, typename Compare, size_t Slot>
+bool SplayTree<T, Compare, Slot>::erase(const T& value) {
+	HealthProbe<SplayTree<T, Compare, Slot>> probe(*this, TreeOp::erase);
+	SNode<T, Compare, Slot>* at = root;
+	while (at != nullptr) {
+		int c = __compare_helper_methods::compare(cmp, value, at->value);
+		if (c == 0) break;
+		if (c < 0)
 			at = at->left;
 		else
 			at = at->right;
 	}
 
-	if (at == nullptr) return;
+	if (at == nullptr) return false;
+	this->erase_node(at);
+	return true;
+}
+
+// Splays at to the root and deletes it with all its copies, joining what hung
+// below it
+template<typename T, typename Compare, size_t Slot>
+void SplayTree<T, Compare, Slot>::erase_node(typename SplayTree<T, Compare, Slot>::Node* at) {
+	if (at == leftmost) leftmost = nullptr;
+	if (at == rightmost) rightmost = nullptr;
 
-	__splay_helper_methods::splay<T>(at);
+	__splay_helper_methods::splay(at);
 	if (at->left)
 		at->left->parent = nullptr;
 	if (at->right)
 		at->right->parent = nullptr;
-	this->root = __splay_helper_methods::join_aux<T>(at->left, at->right);
+	this->root = __splay_helper_methods::join_aux(at->left, at->right);
 
 	delete at;
 }
 
-template<typename T>
-void SplayTree<T>::join(SplayTree<T>& other) {
-	this->root = __splay_helper_methods::join_aux<T>(this->root, other.root);
-	other.root = nullptr;
+template<typename T, typename Compare, size_t Slot>
+void SplayTree<T, Compare, Slot>::join(SplayTree<T, Compare, Slot>& other) {
+	if (other.root != nullptr) {
+		if (this->root == nullptr)
+			this->leftmost = other.leftmost;
+		this->rightmost = other.rightmost;
+	}
+	this->root = __splay_helper_methods::join_aux(this->root, other.root);
+	other.root = other.leftmost = other.rightmost = nullptr;
 }
 
-template<typename T>
-void SplayTree<T>::split(const T& value, SplayTree<T>& other, bool after) {
-	SNode<T>* succ = successor(this->root, value);
-	if (succ) {
-		__splay_helper_methods::splay<T>(succ);
-		other.root = succ;
-		this->root = succ->left;
+// Moves the values from value on, or after it if after is set, into other,
+// which loses what it held first
+template<typename T, typename Compare, size_t Slot>
+void SplayTree<T, Compare, Slot>::split(const T& value, SplayTree<T, Compare, Slot>& other, bool after) {
+	other.clear();
+	SNode<T, Compare, Slot>* first = (after ? __splay_helper_methods::successor(this->root, value, cmp)
+	                                  : __splay_helper_methods::lower_bound(this->root, value, cmp));
+	if (first) {
+		__splay_helper_methods::splay(first);
+		other.root = other.leftmost = first;
+		other.rightmost = this->rightmost;
+		this->root = first->left;
 		if (this->root)
 			this->root->parent = nullptr;
+		else
+			this->leftmost = nullptr;
+		this->rightmost = nullptr;
 		other.root->left = nullptr;
 		other.root->update_parameters();
 	} else {
-		other = SplayTree<T>();
+		other.root = other.leftmost = other.rightmost = nullptr;
 	}
-	if (after == false && this->contains(value)) {
-		this->erase(value);
-		other.insert(value);
-	} 
 }
 
-template<typename T>
-bool SplayTree<T>::contains(const T& value) {
-	SNode<T> *at = root;
+// Detaches the values in [lo, hi] into a new tree with two splits and a join
+template<typename T, typename Compare, size_t Slot>
+SplayTree<T, Compare, Slot> SplayTree<T, Compare, Slot>::extract_range(const T& lo, const T& hi) {
+	SplayTree<T, Compare, Slot> middle(multiset, cmp), right(multiset, cmp);
+	this->split(lo, middle);
+	middle.split(hi, right, true);
+	this->join(right);
+	SNode<T, Compare, Slot> *range = middle.root;
+	middle.root = nullptr;
+	SplayTree<T, Compare, Slot> extracted(range, multiset, cmp);
+	extracted.set_policy(policy, parameter, splay_lookups);
+	return extracted;
+}
+
+// Detaches the values in [lo, hi] like extract_range and returns how many
+// there were. The nodes are only deleted by reclaim or the destructor
+template<typename T, typename Compare, size_t Slot>
+unsigned SplayTree<T, Compare, Slot>::erase_range(const T& lo, const T& hi) {
+	SplayTree<T, Compare, Slot> range = this->extract_range(lo, hi);
+	unsigned removed = range.size();
+	graveyard.push(range.root);
+	range.root = nullptr;
+	return removed;
+}
+
+// Deletes up to budget nodes detached by erase_range, returns how many were deleted
+template<typename T, typename Compare, size_t Slot>
+size_t SplayTree<T, Compare, Slot>::reclaim(size_t budget) {
+	return graveyard.reclaim(budget);
+}
+
+// Returns the node holding key or, if there is none, the last node on the
+// search path. depth is set to the depth of the returned node and c to the
+// comparison of key with it, so callers need not compare again
+template<typename T, typename Compare, size_t Slot>
+template<typename K>
+typename SplayTree<T, Compare, Slot>::Node* SplayTree<T, Compare, Slot>::search(const K& key, unsigned& depth, int& c) {
+	SNode<T, Compare, Slot> *at = root, *last = nullptr;
+	depth = 0;
+	c = 0;
 
 	while (at != nullptr) {
-		if (value == at->value) return true;
-		if (value < at->value)
+		last = at;
+		c = __compare_helper_methods::compare(cmp, key, at->value);
+		if (c == 0) break;
+		depth++;
+		if (c < 0)
 			at = at->left;
 		else
 			at = at->right;
 	}
 
-	return false;
+	if (at == nullptr && last != nullptr) depth--;
+	return last;
+}
+
+// The node holding key or null, the search path is restructured either way
+template<typename T, typename Compare, size_t Slot>
+template<typename K>
+typename SplayTree<T, Compare, Slot>::Node* SplayTree<T, Compare, Slot>::lookup(const K& key) {
+	unsigned depth;
+	int c;
+	SNode<T, Compare, Slot> *at = this->search(key, depth, c);
+	if (at == nullptr) return nullptr;
+	this->access(at, depth);
+	return (c == 0 ? at : nullptr);
+}
+
+// Like lookup, but only restructures if lookups were opted into the policy
+template<typename T, typename Compare, size_t Slot>
+template<typename K>
+typename SplayTree<T, Compare, Slot>::Node* SplayTree<T, Compare, Slot>::read(const K& key) {
+	if (splay_lookups)
+		return this->lookup(key);
+	unsigned depth;
+	int c;
+	SNode<T, Compare, Slot> *at = this->search(key, depth, c);
+	return (at != nullptr && c == 0 ? at : nullptr);
+}
+
+template<typename T, typename Compare, size_t Slot>
+bool SplayTree<T, Compare, Slot>::contains(const T& value) {
+	HealthProbe<SplayTree<T, Compare, Slot>> probe(*this, TreeOp::lookup);
+	return this->read(value) != nullptr;
+}
+
+template<typename T, typename Compare, size_t Slot>
+unsigned SplayTree<T, Compare, Slot>::count(const T& value) {
+	HealthProbe<SplayTree<T, Compare, Slot>> probe(*this, TreeOp::lookup);
+	SNode<T, Compare, Slot> *at = this->read(value);
+	return (at == nullptr ? 0 : at->count);
+}
+
+template<typename T, typename Compare, size_t Slot>
+template<typename K, typename C, typename>
+bool SplayTree<T, Compare, Slot>::contains(const K& key) {
+	HealthProbe<SplayTree<T, Compare, Slot>> probe(*this, TreeOp::lookup);
+	return this->read(key) != nullptr;
+}
+
+template<typename T, typename Compare, size_t Slot>
+template<typename K, typename C, typename>
+unsigned SplayTree<T, Compare, Slot>::count(const K& key) {
+	HealthProbe<SplayTree<T, Compare, Slot>> probe(*this, TreeOp::lookup);
+	SNode<T, Compare, Slot> *at = this->read(key);
+	return (at == nullptr ? 0 : at->count);
+}
+
+template<typename T, typename Compare, size_t Slot>
+bool SplayTree<T, Compare, Slot>::erase_one(const T& value) {
+	HealthProbe<SplayTree<T, Compare, Slot>> probe(*this, TreeOp::erase);
+	unsigned depth;
+	int c;
+	SNode<T, Compare, Slot> *at = this->search(value, depth, c);
+	if (at == nullptr || c != 0) return false;
+	if (at->count == 1) {
+		this->erase(value);
+		return true;
+	}
+	at->count--;
+	at->update_parameters();
+	if (!this->access(at, depth))
+		update_path(at->parent);
+	return true;
+}
+
+template<typename T, typename Compare, size_t Slot>
+unsigned SplayTree<T, Compare, Slot>::erase_all(const T& value) {
+	HealthProbe<SplayTree<T, Compare, Slot>> probe(*this, TreeOp::erase);
+	unsigned depth;
+	int c;
+	SNode<T, Compare, Slot> *at = this->search(value, depth, c);
+	if (at == nullptr || c != 0) return 0;
+	unsigned removed = at->count;
+	this->erase(value);
+	return removed;
+}
+
+template<typename T, typename Compare, size_t Slot>
+const T& SplayTree<T, Compare, Slot>::kth(unsigned k) {
+	if (k >= this->size())
+		throw std::out_of_range("Index out of range!");
+	SNode<T, Compare, Slot> *at = root;
+	unsigned depth = 0;
+
+	while (true) {
+		unsigned left_size = __splay_helper_methods::get_size(at->left);
+		if (k < left_size) {
+			at = at->left;
+		} else if (k < left_size + at->count) {
+			break;
+		} else {
+			k -= left_size + at->count;
+			at = at->right;
+		}
+		depth++;
+	}
+
+	if (splay_lookups)
+		this->access(at, depth);
+	return at->value;
+}
+
+template<typename T, typename Compare, size_t Slot>
+unsigned SplayTree<T, Compare, Slot>::rank(const T& value) {
+	unsigned smaller = 0;
+	SNode<T, Compare, Slot> *at = root, *last = nullptr;
+	unsigned depth = 0;
+
+	while (at != nullptr) {
+		last = at;
+		if (cmp(at->value, value)) {
+			smaller += __splay_helper_methods::get_size(at->left) + at->count;
+			at = at->right;
+		} else {
+			at = at->left;
+		}
+		depth++;
+	}
+
+	if (splay_lookups && last != nullptr)
+		this->access(last, depth - 1);
+	return smaller;
+}
+
+template<typename T, typename Compare, size_t Slot>
+typename SplayTree<T, Compare, Slot>::Node* SplayTree<T, Compare, Slot>::min_node() {
+	if (leftmost == nullptr && root != nullptr) {
+		leftmost = root;
+		while (leftmost->left != nullptr)
+			leftmost = leftmost->left;
+	}
+	return leftmost;
+}
+
+template<typename T, typename Compare, size_t Slot>
+typename SplayTree<T, Compare, Slot>::Node* SplayTree<T, Compare, Slot>::max_node() {
+	if (rightmost == nullptr && root != nullptr) {
+		rightmost = root;
+		while (rightmost->right != nullptr)
+			rightmost = rightmost->right;
+	}
+	return rightmost;
+}
+
+// Reading an end does not count as an access, it leaves the tree untouched
+template<typename T, typename Compare, size_t Slot>
+const T& SplayTree<T, Compare, Slot>::min() {
+	if (this->empty())
+		throw std::out_of_range("Empty tree!");
+	return this->min_node()->value;
+}
+
+template<typename T, typename Compare, size_t Slot>
+const T& SplayTree<T, Compare, Slot>::max() {
+	if (this->empty())
+		throw std::out_of_range("Empty tree!");
+	return this->max_node()->value;
+}
+
+template<typename T, typename Compare, size_t Slot>
+T SplayTree<T, Compare, Slot>::pop_min() {
+	return this->pop(true);
+}
+
+template<typename T, typename Compare, size_t Slot>
+T SplayTree<T, Compare, Slot>::pop_max() {
+	return this->pop(false);
+}
+
+// Removes one copy of the smallest or largest value without comparing any
+// keys. The end is splayed to the root like any erase, after which it has no
+// inner child, so repeated pops from the same side cost amortized O(1)
+template<typename T, typename Compare, size_t Slot>
+T SplayTree<T, Compare, Slot>::pop(bool smallest) {
+	if (this->empty())
+		throw std::out_of_range("Empty tree!");
+	SNode<T, Compare, Slot> *x = (smallest ? this->min_node() : this->max_node());
+	__splay_helper_methods::splay(x);
+	this->root = x;
+	if (x->count > 1) {
+		x->count--;
+		x->update_parameters();
+		return x->value;
+	}
+
+	SNode<T, Compare, Slot> *outer = (smallest ? x->right : x->left);
+	this->root = outer;
+	if (outer != nullptr)
+		outer->parent = nullptr;
+	// The next end is the innermost node of the outer subtree
+	SNode<T, Compare, Slot> *next = outer;
+	while (next != nullptr && (smallest ? next->left : next->right) != nullptr)
+		next = (smallest ? next->left : next->right);
+	(smallest ? leftmost : rightmost) = next;
+	if (this->root == nullptr)
+		leftmost = rightmost = nullptr;
+	T value = std::move(x->value);
+	delete x;
+	return value;
+}
+
+// Calls f once for every element, from several threads and in no particular
+// order. Nothing is splayed, so the tree is only read
+template<typename T, typename Compare, size_t Slot>
+template<typename F>
+void SplayTree<T, Compare, Slot>::parallel_for_each(F f, unsigned threads) {
+	__parallel_helper_methods::for_each_value(this->root, f, std::max(1u, threads));
+}
+
+// Folds map(value) of every element in order with combine, which must be associative
+template<typename T, typename Compare, size_t Slot>
+template<typename R, typename Map, typename Combine>
+R SplayTree<T, Compare, Slot>::parallel_reduce(R identity, Map map, Combine combine, unsigned threads) {
+	return __parallel_helper_methods::reduce_values(this->root, identity, map, combine, std::max(1u, threads));
+}
+
+// Returns a new tree with the values satisfying pred. Above the grain, while
+// threads remain, a kept node stays above its filtered subtrees and the
+// subtrees of a dropped node are joined. Below it the kept values of a subtree
+// are copied in order with an explicit stack and linked into a balanced
+// subtree, so a degenerate source cannot overflow the call stack
+template<typename T, typename Compare, size_t Slot>
+template<typename Pred>
+SplayTree<T, Compare, Slot> SplayTree<T, Compare, Slot>::parallel_filter(Pred pred, unsigned threads) {
+	SplayTree<T, Compare, Slot> filtered(parallel_filter(this->root, pred, std::max(1u, threads)), multiset, cmp);
+	filtered.policy = policy;
+	filtered.parameter = parameter;
+	filtered.splay_lookups = splay_lookups;
+	return filtered;
+}
+
+template<typename T, typename Compare, size_t Slot>
+template<typename Pred>
+typename SplayTree<T, Compare, Slot>::Node* SplayTree<T, Compare, Slot>::parallel_filter(typename SplayTree<T, Compare, Slot>::Node* x, Pred& pred, unsigned threads) {
+	if (x == nullptr) return nullptr;
+	if (threads <= 1 || x->size < __parallel_helper_methods::grain) {
+		std::vector<SNode<T, Compare, Slot>*> kept;
+		__parallel_helper_methods::in_order((const SNode<T, Compare, Slot>*) x, [&](const SNode<T, Compare, Slot>* at) {
+			if (!pred(at->value)) return;
+			kept.push_back(new SNode<T, Compare, Slot>(at->value));
+			kept.back()->count = at->count;
+		});
+		return __splay_helper_methods::link(kept.data(), 0, kept.size());
+	}
+	unsigned left_threads = __parallel_helper_methods::share(threads, __splay_helper_methods::get_size(x->left), x->size);
+	SNode<T, Compare, Slot> *left, *right;
+	__parallel_helper_methods::fork(threads,
+		[&] { left = parallel_filter(x->left, pred, left_threads); },
+		[&] { right = parallel_filter(x->right, pred, __parallel_helper_methods::rest(threads, left_threads)); });
+	if (!pred(x->value))
+		return __splay_helper_methods::join_aux(left, right);
+	SNode<T, Compare, Slot> *kept = new SNode<T, Compare, Slot>(x->value);
+	kept->count = x->count;
+	kept->set_left(left);
+	kept->set_right(right);
+	return kept;
+}
+
+// Whether the tree is in key order with exact sizes and heights, every parent
+// link matches and the cached ends, where known, are its first and last nodes
+template<typename T, typename Compare, size_t Slot>
+bool SplayTree<T, Compare, Slot>::verify() {
+	SNode<T, Compare, Slot> *first = root, *last = root;
+	while (first != nullptr && first->left != nullptr)
+		first = first->left;
+	while (last != nullptr && last->right != nullptr)
+		last = last->right;
+	if ((leftmost != nullptr && leftmost != first) || (rightmost != nullptr && rightmost != last))
+		return false;
+	return this->verify(this->root, nullptr, nullptr, nullptr) >= 0;
+}
+
+// The height of x's subtree, or -1 if it breaks an invariant
+template<typename T, typename Compare, size_t Slot>
+int SplayTree<T, Compare, Slot>::verify(typename SplayTree<T, Compare, Slot>::Node* x, typename SplayTree<T, Compare, Slot>::Node* parent,
+                                        const T* lo, const T* hi) {
+	if (x == nullptr)
+		return 0;
+	if (x->parent != parent || x->count == 0 || (!multiset && x->count > 1))
+		return -1;
+	if ((lo != nullptr && !cmp(*lo, x->value)) || (hi != nullptr && !cmp(x->value, *hi)))
+		return -1;
+	int hl = this->verify(x->left, x, lo, &x->value);
+	int hr = this->verify(x->right, x, &x->value, hi);
+	if (hl < 0 || hr < 0 || x->height != 1 + (unsigned) std::max(hl, hr))
+		return -1;
+	if (x->size != __splay_helper_methods::get_size(x->left) + x->count + __splay_helper_methods::get_size(x->right))
+		return -1;
+	return x->height;
 }
 
 #endif
@@ -0,0 +1,191 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+// Binary trace of tree operations
+//
+// The file starts with the magic "TRCE", a version byte and the size of the
+// value type. Every record is one op byte followed by the raw bytes of the
+// value (join records carry no value).
+//
+// split(v) moves every value >= v to a side tree, which must be empty, and
+// join() appends the side tree back, whose values must all lie above the main
+// tree's. This is the only multi-tree pattern the format knows about, so a
+// replay needs just a main and a side tree. The recorder throws
+// std::invalid_argument on a split or join that breaks these rules, before
+// writing it, and replay rejects a trace that holds one.
+
+enum class TraceOp : uint8_t { insert, erase, contains, split, join };
+
+template<typename T>
+struct TraceRecord {
+	TraceOp op;
+	T value;
+};
+
+template<typename T>
+class TraceWriter {
+  public:
+	TraceWriter(const std::string& path);
+	void write(TraceOp op, const T& value = T());
+	void flush();
+
+  private:
+	std::ofstream out;
+};
+
+template<typename T>
+class TraceReader {
+  public:
+	TraceReader(const std::string& path);
+	bool next(TraceRecord<T>& record);
+	std::vector<TraceRecord<T>> read_all();
+
+  private:
+	std::ifstream in;
+};
+
+// Forwards every operation to the tree and logs it to the writer. Values are
+// ordered by their operator<
+template<typename T, typename Tree>
+class TraceRecorder {
+  public:
+	TraceRecorder(Tree& _tree, TraceWriter<T>& _writer);
+	bool insert(const T& value);
+	void erase(const T& value);
+	bool contains(const T& value);
+	void split(const T& value, Tree& other);
+	void join(Tree& other);
+	Tree& tree();
+
+  private:
+	Tree& recorded;
+	TraceWriter<T>& writer;
+};
+
+namespace __trace_helper_methods {
+	const char magic[4] = {'T', 'R', 'C', 'E'};
+	const uint8_t version = 1;
+
+	inline bool has_value(TraceOp op) {
+		return op != TraceOp::join;
+	}
+}
+
+///////// Implementation Starts Here
+
+template<typename T>
+TraceWriter<T>::TraceWriter(const std::string& path) : out(path, std::ios::binary) {
+	static_assert(std::is_trivially_copyable<T>::value, "Traced values are stored as raw bytes");
+	if (!out)
+		throw std::runtime_error("Could not open trace " + path);
+	const uint8_t header[2] = {__trace_helper_methods::version, (uint8_t) sizeof(T)};
+	out.write(__trace_helper_methods::magic, sizeof(__trace_helper_methods::magic));
+	out.write((const char*) header, sizeof(header));
+}
+
+template<typename T>
+void TraceWriter<T>::write(TraceOp op, const T& value) {
+	out.put((char) op);
+	if (__trace_helper_methods::has_value(op))
+		out.write((const char*) &value, sizeof(T));
+}
+
+template<typename T>
+void TraceWriter<T>::flush() {
+	out.flush();
+}
+
+template<typename T>
+TraceReader<T>::TraceReader(const std::string& path) : in(path, std::ios::binary) {
+	static_assert(std::is_trivially_copyable<T>::value, "Traced values are stored as raw bytes");
+	if (!in)
+		throw std::runtime_error("Could not open trace " + path);
+	char magic[4];
+	uint8_t header[2];
+	in.read(magic, sizeof(magic));
+	in.read((char*) header, sizeof(header));
+	if (!in || std::memcmp(magic, __trace_helper_methods::magic, sizeof(magic)) != 0)
+		throw std::runtime_error("Not a trace file: " + path);
+	if (header[0] != __trace_helper_methods::version)
+		throw std::runtime_error("Unsupported trace version in " + path);
+	if (header[1] != sizeof(T))
+		throw std::runtime_error("Trace value size does not match in " + path);
+}
+
+template<typename T>
+bool TraceReader<T>::next(TraceRecord<T>& record) {
+	int op = in.get();
+	if (op == std::char_traits<char>::eof())
+		return false;
+	if (op > (int) TraceOp::join)
+		throw std::runtime_error("Corrupted trace record");
+	record.op = (TraceOp) op;
+	record.value = T();
+	if (__trace_helper_methods::has_value(record.op)) {
+		in.read((char*) &record.value, sizeof(T));
+		if (!in)
+			throw std::runtime_error("Truncated trace record");
+	}
+	return true;
+}
+
+template<typename T>
+std::vector<TraceRecord<T>> TraceReader<T>::read_all() {
+	std::vector<TraceRecord<T>> records;
+	TraceRecord<T> record;
+	while (next(record))
+		records.push_back(record);
+	return records;
+}
+
+template<typename T, typename Tree>
+TraceRecorder<T, Tree>::TraceRecorder(Tree& _tree, TraceWriter<T>& _writer) : recorded(_tree), writer(_writer) {}
+
+template<typename T, typename Tree>
+bool TraceRecorder<T, Tree>::insert(const T& value) {
+	writer.write(TraceOp::insert, value);
+	return recorded.insert(value);
+}
+
+template<typename T, typename Tree>
+void TraceRecorder<T, Tree>::erase(const T& value) {
+	writer.write(TraceOp::erase, value);
+	recorded.erase(value);
+}
+
+template<typename T, typename Tree>
+bool TraceRecorder<T, Tree>::contains(const T& value) {
+	writer.write(TraceOp::contains, value);
+	return recorded.contains(value);
+}
+
+template<typename T, typename Tree>
+void TraceRecorder<T, Tree>::split(const T& value, Tree& other) {
+	if (!other.empty())
+		throw std::invalid_argument("Split into a non-empty side tree");
+	writer.write(TraceOp::split, value);
+	recorded.split(value, other);
+}
+
+template<typename T, typename Tree>
+void TraceRecorder<T, Tree>::join(Tree& other) {
+	if (!recorded.empty() && !other.empty() && !(recorded.max() < other.min()))
+		throw std::invalid_argument("Join of overlapping trees");
+	writer.write(TraceOp::join);
+	recorded.join(other);
+}
+
+template<typename T, typename Tree>
+Tree& TraceRecorder<T, Tree>::tree() {
+	return recorded;
+}
+
+#endif
@@ -6,135 +6,453 @@
 #include <chrono>
 #include <random>
 #include <stack>
+#include <stdexcept>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include "parallel.hpp"
+#include "deferred_free.hpp"
+#include "compare.hpp"
+#include "health.hpp"
+
+template<typename T, typename Compare>
+class AdaptiveSet;
 
-template<typename T>
+namespace helper_methods {
+	// Only the nodes of a canonical treap carry hashes, the others pay nothing for them
+	template<bool Canonical>
+	struct NodeHashes {};
+
+	template<>
+	struct NodeHashes<true> {
+		uint64_t value_hash, hash; // keyed hash of the value and Merkle hash of the subtree
+	};
+}
+
+// A canonical treap takes its priorities from the keyed hash of the values,
+// so equal contents always give the same shape and the same root hash. It
+// needs std::hash<T>, the plain treap does not
+template<typename T, typename Compare = std::less<T>, bool Canonical = false, size_t Slot = 0>
 class Treap {
   public:
-	struct Node {
+	struct Node : helper_methods::NodeHashes<Canonical> {
 		T value;
-		unsigned priority, size, height;
+		unsigned count, priority, size, height;
 		Node *left, *right;
-		Node(T _value = T()) : value(_value), priority(rng()), size(1), height(1),
-							   left(nullptr), right(nullptr) {}
+		Node(T _value = T(), unsigned _count = 1); // priority from the hash if canonical, else from rng
+		Node(T _value, unsigned _count, unsigned _priority);
 		void update_parameters();
 		void set_left(Node* x);
 		void set_right(Node* x);
 
 		static std::mt19937 rng;
+		static uint64_t hash_key; // must match across replicas for their treaps to be comparable
+		// At least Slot bytes each, so AdaptiveSet can rebuild a node of another tree in place
+		static void* operator new(size_t bytes) { return ::operator new(std::max(bytes, Slot)); }
+		static void operator delete(void* p) { ::operator delete(p); }
 	};
 
-	Treap();
+	Treap(bool _multiset = false, const Compare& _cmp = Compare());
+	Treap(const Treap<T, Compare, Canonical, Slot>& other);
+	Treap(Treap<T, Compare, Canonical, Slot>&& other);
 	~Treap();
+	Treap<T, Compare, Canonical, Slot>& operator=(const Treap<T, Compare, Canonical, Slot>& other);
+	Treap<T, Compare, Canonical, Slot>& operator=(Treap<T, Compare, Canonical, Slot>&& other);
+	void swap(Treap<T, Compare, Canonical, Slot>& other);
+	Treap<T, Compare, Canonical, Slot> clone(unsigned threads = __parallel_helper_methods::default_threads());
 	unsigned size();
 	unsigned height();
 	bool empty();
+	void clear();
+	template<typename Iterator>
+	void build(Iterator first, Iterator last, unsigned threads = __parallel_helper_methods::default_threads());
 	bool insert(const T& value);
-	void erase(const T& value);
+	bool erase(const T& value);
+	bool erase_one(const T& value);
+	unsigned erase_all(const T& value);
+	unsigned count(const T& value);
 	bool contains(const T& value);
-	void split(const T& value, Treap<T>& other, bool after=false);
-	void join(Treap<T>& other);
+	// Heterogeneous lookups, see compare.hpp
+	template<typename K, typename C = Compare, typename = typename C::is_transparent>
+	unsigned count(const K& key);
+	template<typename K, typename C = Compare, typename = typename C::is_transparent>
+	bool contains(const K& key);
+	const T& kth(unsigned k);
+	unsigned rank(const T& value);
+	const T& min();
+	const T& max();
+	T pop_min();
+	T pop_max();
+	void split(const T& value, Treap<T, Compare, Canonical, Slot>& other, bool after=false);
+	void join(Treap<T, Compare, Canonical, Slot>& other);
+	Treap<T, Compare, Canonical, Slot> extract_range(const T& lo, const T& hi);
+	unsigned erase_range(const T& lo, const T& hi);
+	size_t reclaim(size_t budget = (size_t) -1);
+	TreeHealth& health();
+	ShapeReport shape_report();
+	bool poll();
+	template<typename F>
+	void parallel_for_each(F f, unsigned threads = __parallel_helper_methods::default_threads());
+	template<typename R, typename Map, typename Combine>
+	R parallel_reduce(R identity, Map map, Combine combine, unsigned threads = __parallel_helper_methods::default_threads());
+	template<typename Pred>
+	Treap<T, Compare, Canonical, Slot> parallel_filter(Pred pred, unsigned threads = __parallel_helper_methods::default_threads());
+	bool verify();
+	uint64_t hash();
+	bool equals(Treap<T, Compare, Canonical, Slot>& other);
+	static void diff(Treap<T, Compare, Canonical, Slot>& a, Treap<T, Compare, Canonical, Slot>& b, std::vector<T>& only_a, std::vector<T>& only_b);
 
   private:
-	Treap<T>::Node *root;
+	friend class AdaptiveSet<T, Compare>;
+	Treap(Node* _root, bool _multiset, const Compare& _cmp);
+	Treap<T, Compare, Canonical, Slot>::Node *root;
+	bool multiset; // keeps one node per key with a multiplicity counter
+	Compare cmp;
+	Node *leftmost, *rightmost; // see compare.hpp
+	DeferredFree<Node> graveyard;
+	TreeHealth monitor; // off until enabled, stays with this object through moves and swaps
 	static void grab_pointers(std::stack<Node*>&, Node*);
+	template<typename K>
+	Node* find(const K& key);
+	Node* min_node();
+	Node* max_node();
+	T pop(bool smallest);
+	static Node* pop(Node* node, bool smallest, Node*& end, Node*& next);
+	Node* build(const T* values, const unsigned* counts, size_t lo, size_t hi, std::mt19937& rng, unsigned threads);
+	Node* build_canonical(const T* values, const unsigned* counts, size_t lo, size_t hi);
+	void diff(Node* x, const T* x_lo, const T* x_hi, Node* y, const T* y_lo, const T* y_hi,
+	          const T* lo, const T* hi, std::vector<T>& only_x, std::vector<T>& only_y);
+	unsigned add_to_path(Node* node, const T& value, int delta);
+	template<typename Pred>
+	static Node* parallel_filter(Node* node, Pred& pred, unsigned threads);
+	int verify(Node* node, const T* lo, const T* hi);
 };
 
-template<typename T>
-using TNode = typename Treap<T>::Node;
+template<typename T, typename Compare = std::less<T>, bool Canonical = false, size_t Slot = 0>
+using TNode = typename Treap<T, Compare, Canonical, Slot>::Node;
 
-template<typename T>
-std::mt19937 Treap<T>::Node::rng(std::chrono::system_clock::now().time_since_epoch().count());
+template<typename T, typename Compare = std::less<T>>
+using CanonicalTreap = Treap<T, Compare, true>;
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+std::mt19937 Treap<T, Compare, Canonical, Slot>::Node::rng(std::chrono::system_clock::now().time_since_epoch().count());
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+uint64_t Treap<T, Compare, Canonical, Slot>::Node::hash_key = 0x2545f4914f6cdd1dull;
 
 namespace helper_methods {
-	template<typename T>
-	unsigned get_size(TNode<T>* node);
+	template<typename Node>
+	unsigned get_size(Node* node);
 
-	template<typename T>
-	unsigned get_height(TNode<T>* node);
+	template<typename Node>
+	unsigned get_height(Node* node);
 
-	template<typename T>
-	TNode<T>* join_aux(TNode<T> *left, TNode<T> *right);
+	template<typename Node>
+	Node* join_aux(Node *left, Node *right);
 
-	template<typename T>
-	std::pair<TNode<T>*, TNode<T>*> split_before(const T& value, TNode<T> *tree);
+	template<typename Node, typename Compare>
+	void heapify(Node *node, const Compare& cmp);
+
+	template<typename Node, typename Compare>
+	bool has_priority(Node *a, Node *b, const Compare& cmp);
 
 	template<typename T>
-	std::pair<TNode<T>*, TNode<T>*> split_after(const T& value, TNode<T> *tree);
+	uint64_t digest(const T& value, uint64_t key);
+
+	uint64_t mix(uint64_t x);
+
+	template<typename Node>
+	uint64_t get_hash(Node* node);
+
+	template<typename Node, typename T, typename Compare>
+	void collect(Node* node, const T* lo, const T* hi, std::vector<T>& out, const Compare& cmp);
+
+	template<typename Node, typename K, typename Compare>
+	std::pair<Node*, Node*> split_before(const K& value, Node *tree, const Compare& cmp);
+
+	template<typename Node, typename K, typename Compare>
+	std::pair<Node*, Node*> split_after(const K& value, Node *tree, const Compare& cmp);
 }
 
 ///////// Implementation Starts Here
 
-template<typename T>
-void Treap<T>::grab_pointers(std::stack<Treap<T>::Node*>& stk, Treap<T>::Node* at) {
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+void Treap<T, Compare, Canonical, Slot>::grab_pointers(std::stack<Treap<T, Compare, Canonical, Slot>::Node*>& stk, Treap<T, Compare, Canonical, Slot>::Node* at) {
 	if (at == nullptr) return;
 	grab_pointers(stk, at->left);
 	stk.push(at);
 	grab_pointers(stk, at->right);
 }
 
-template<typename T>
-Treap<T>::~Treap<T>() {
-	std::stack<TNode<T>*> pointers;
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+Treap<T, Compare, Canonical, Slot>::Treap(const Treap<T, Compare, Canonical, Slot>& other) : root(__parallel_helper_methods::clone(other.root, 1)),
+                                                           multiset(other.multiset),
+                                                           cmp(other.cmp), leftmost(nullptr), rightmost(nullptr) {}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+Treap<T, Compare, Canonical, Slot>::Treap(Treap<T, Compare, Canonical, Slot>&& other) : root(other.root), multiset(other.multiset),
+                                                      cmp(other.cmp), leftmost(other.leftmost), rightmost(other.rightmost),
+                                                      graveyard(std::move(other.graveyard)) {
+	other.root = other.leftmost = other.rightmost = nullptr;
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+Treap<T, Compare, Canonical, Slot>& Treap<T, Compare, Canonical, Slot>::operator=(const Treap<T, Compare, Canonical, Slot>& other) {
+	if (this != &other) {
+		Treap<T, Compare, Canonical, Slot> copy(other);
+		this->swap(copy);
+	}
+	return *this;
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+Treap<T, Compare, Canonical, Slot>& Treap<T, Compare, Canonical, Slot>::operator=(Treap<T, Compare, Canonical, Slot>&& other) {
+	if (this != &other) {
+		this->clear();
+		this->swap(other);
+	}
+	return *this;
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+void Treap<T, Compare, Canonical, Slot>::swap(Treap<T, Compare, Canonical, Slot>& other) {
+	std::swap(root, other.root);
+	std::swap(multiset, other.multiset);
+	std::swap(cmp, other.cmp);
+	std::swap(leftmost, other.leftmost);
+	std::swap(rightmost, other.rightmost);
+	graveyard.swap(other.graveyard);
+}
+
+// Copies the nodes directly, priorities and hashes included. Subtrees are
+// copied in parallel while threads remain
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+Treap<T, Compare, Canonical, Slot> Treap<T, Compare, Canonical, Slot>::clone(unsigned threads) {
+	return Treap<T, Compare, Canonical, Slot>(__parallel_helper_methods::clone(this->root, std::max(1u, threads)), multiset, cmp);
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+Treap<T, Compare, Canonical, Slot>::~Treap() {
+	this->clear();
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+void Treap<T, Compare, Canonical, Slot>::clear() {
+	std::stack<TNode<T, Compare, Canonical, Slot>*> pointers;
 	grab_pointers(pointers, this->root);
 	while (not pointers.empty()) {
 		delete pointers.top();
 		pointers.pop();
 	}
+	this->root = this->leftmost = this->rightmost = nullptr;
 }
 
-template<typename T>
-unsigned helper_methods::get_size(TNode<T> *node) {
+// Replaces the contents with the values in [first, last), which may be unsorted
+// and have duplicates. Sorting, deduplication and the construction of the
+// tree are all split among the given number of threads
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+template<typename Iterator>
+void Treap<T, Compare, Canonical, Slot>::build(Iterator first, Iterator last, unsigned threads) {
+	this->clear();
+	threads = std::max(1u, threads);
+	std::vector<T> values(first, last), buffer(values.size());
+	std::vector<unsigned> counts(multiset ? values.size() : 0);
+	T* begin = values.data();
+	__parallel_helper_methods::sort(begin, begin + values.size(), buffer.data(), cmp, threads);
+	size_t distinct = __parallel_helper_methods::unique_runs(begin, begin + values.size(), buffer.data(),
+	                                                         (multiset ? counts.data() : nullptr), cmp, threads);
+	if constexpr (Canonical) {
+		// The shape is fixed by the priorities, each chunk is built on its own and then joined
+		std::vector<TNode<T, Compare, Canonical, Slot>*> parts(threads, nullptr);
+		__parallel_helper_methods::for_chunks(distinct, threads, [&](unsigned chunk, size_t lo, size_t hi) {
+			parts[chunk] = build_canonical(buffer.data(), (multiset ? counts.data() : nullptr), lo, hi);
+		});
+		for (TNode<T, Compare, Canonical, Slot>* part : parts)
+			this->root = helper_methods::join_aux(this->root, part);
+	} else {
+		std::mt19937 rng(Node::rng());
+		this->root = build(buffer.data(), (multiset ? counts.data() : nullptr), 0, distinct, rng, threads);
+	}
+}
+
+// Builds the treap of sorted distinct values in linear time, keeping its
+// right spine on a stack
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+typename Treap<T, Compare, Canonical, Slot>::Node* Treap<T, Compare, Canonical, Slot>::build_canonical(const T* values, const unsigned* counts, size_t lo, size_t hi) {
+	std::vector<TNode<T, Compare, Canonical, Slot>*> spine;
+	for (size_t i = lo; i < hi; i++) {
+		TNode<T, Compare, Canonical, Slot> *node = new TNode<T, Compare, Canonical, Slot>(values[i], (counts ? counts[i] : 1));
+		TNode<T, Compare, Canonical, Slot> *last = nullptr;
+		while (!spine.empty() && !helper_methods::has_priority(spine.back(), node, cmp)) {
+			last = spine.back();
+			spine.pop_back();
+			last->update_parameters();
+		}
+		node->left = last;
+		if (!spine.empty())
+			spine.back()->right = node;
+		spine.push_back(node);
+	}
+	while (spine.size() > 1) {
+		spine.back()->update_parameters();
+		spine.pop_back();
+	}
+	if (spine.empty()) return nullptr;
+	spine.back()->update_parameters();
+	return spine.back();
+}
+
+// The shape is balanced by position and the priorities are then sifted down
+// into heap order. Forked subtrees draw priorities from their own generator
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+typename Treap<T, Compare, Canonical, Slot>::Node* Treap<T, Compare, Canonical, Slot>::build(const T* values, const unsigned* counts, size_t lo, size_t hi,
+                                         std::mt19937& rng, unsigned threads) {
+	if (lo == hi) return nullptr;
+	if (hi - lo < __parallel_helper_methods::grain) threads = 1;
+	size_t mid = lo + (hi - lo) / 2;
+	TNode<T, Compare, Canonical, Slot> *node = new TNode<T, Compare, Canonical, Slot>(values[mid], (counts ? counts[mid] : 1), rng());
+	if (threads <= 1) {
+		node->left = build(values, counts, lo, mid, rng, 1);
+		node->right = build(values, counts, mid + 1, hi, rng, 1);
+	} else {
+		std::mt19937 forked_rng(rng());
+		__parallel_helper_methods::fork(threads,
+			[&] { node->left = build(values, counts, lo, mid, forked_rng, threads / 2); },
+			[&] { node->right = build(values, counts, mid + 1, hi, rng, threads - threads / 2); });
+	}
+	node->update_parameters();
+	helper_methods::heapify(node, cmp);
+	return node;
+}
+
+template<typename Node>
+unsigned helper_methods::get_size(Node *node) {
 	return (node == nullptr ? 0 : node->size);
 }
 
-template<typename T>
-unsigned helper_methods::get_height(TNode<T> *node) {
+template<typename Node>
+unsigned helper_methods::get_height(Node *node) {
 	return (node == nullptr ? 0 : node->height);
 }
 
-template<typename T>
-void Treap<T>::Node::update_parameters() {
-	this->height = 1 + std::max(helper_methods::get_height<T>(left), helper_methods::get_height<T>(right));
-	this->size = helper_methods::get_size<T>(left) + 1 + helper_methods::get_size<T>(right);
+template<typename Node>
+uint64_t helper_methods::get_hash(Node *node) {
+	return (node == nullptr ? 0 : node->hash);
+}
+
+// splitmix64 finalizer
+inline uint64_t helper_methods::mix(uint64_t x) {
+	x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27; x *= 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
 }
 
 template<typename T>
-void Treap<T>::Node::set_right(Treap<T>::Node* x) {
+uint64_t helper_methods::digest(const T& value, uint64_t key) {
+	return mix(std::hash<T>()(value) ^ key);
+}
+
+// A canonical node hashes its value once and never touches the shared generator
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+Treap<T, Compare, Canonical, Slot>::Node::Node(T _value, unsigned _count)
+	: value(_value), count(_count), priority(0), size(_count), height(1), left(nullptr), right(nullptr) {
+	if constexpr (Canonical) {
+		this->value_hash = helper_methods::digest(value, hash_key);
+		priority = this->value_hash >> 32;
+	} else {
+		priority = rng();
+	}
+	update_parameters();
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+Treap<T, Compare, Canonical, Slot>::Node::Node(T _value, unsigned _count, unsigned _priority)
+	: value(_value), count(_count), priority(_priority), size(_count), height(1), left(nullptr), right(nullptr) {
+	if constexpr (Canonical)
+		this->value_hash = helper_methods::digest(value, hash_key);
+	update_parameters();
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+void Treap<T, Compare, Canonical, Slot>::Node::update_parameters() {
+	this->height = 1 + std::max(helper_methods::get_height(left), helper_methods::get_height(right));
+	this->size = helper_methods::get_size(left) + count + helper_methods::get_size(right);
+	if constexpr (Canonical) {
+		uint64_t self = helper_methods::mix(this->value_hash + count);
+		this->hash = helper_methods::mix(helper_methods::mix(helper_methods::get_hash(left) + self)
+		                                 ^ (helper_methods::get_hash(right) * 0x9e3779b97f4a7c15ull));
+	}
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+void Treap<T, Compare, Canonical, Slot>::Node::set_right(Treap<T, Compare, Canonical, Slot>::Node* x) {
 	right = x;
 	update_parameters();
 }
 
-template<typename T>
-void Treap<T>::Node::set_left(Treap<T>::Node* x) {
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+void Treap<T, Compare, Canonical, Slot>::Node::set_left(Treap<T, Compare, Canonical, Slot>::Node* x) {
 	left = x;
 	update_parameters();
 }
 
-template<typename T>
-Treap<T>::Treap() : root(nullptr) {}
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+Treap<T, Compare, Canonical, Slot>::Treap(bool _multiset, const Compare& _cmp)
+	: root(nullptr), multiset(_multiset), cmp(_cmp), leftmost(nullptr), rightmost(nullptr) {}
 
-template<typename T>
-unsigned Treap<T>::size() {
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+Treap<T, Compare, Canonical, Slot>::Treap(typename Treap<T, Compare, Canonical, Slot>::Node* _root, bool _multiset, const Compare& _cmp)
+	: root(_root), multiset(_multiset), cmp(_cmp), leftmost(nullptr), rightmost(nullptr) {}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+unsigned Treap<T, Compare, Canonical, Slot>::size() {
 	return (this->root == nullptr ? 0 : this->root->size);
 }
 
-template<typename T>
-unsigned Treap<T>::height() {
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+unsigned Treap<T, Compare, Canonical, Slot>::height() {
 	return (this->root == nullptr ? 0 : this->root->height);
 }
 
-template<typename T>
-bool Treap<T>::empty() {
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+bool Treap<T, Compare, Canonical, Slot>::empty() {
 	return (this->root == nullptr);
 }
 
-template<typename T>
-bool Treap<T>::insert(const T& value) {
-	if (this->contains(value)) return false;
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+TreeHealth& Treap<T, Compare, Canonical, Slot>::health() {
+	return monitor;
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+ShapeReport Treap<T, Compare, Canonical, Slot>::shape_report() {
+	ShapeReport report = __health_helper_methods::shape_of(root, size(), std::max(sizeof(Node), Slot));
+	monitor.observe(report);
+	return report;
+}
+
+// Settles a drift the sampled operations left pending with one shape report,
+// and returns whether it ran the drift callback. O(1) with none pending
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+bool Treap<T, Compare, Canonical, Slot>::poll() {
+	if (!monitor.pending())
+		return false;
+	ShapeReport report = __health_helper_methods::shape_of(root, size(), std::max(sizeof(Node), Slot));
+	return monitor.observe(report);
+}
 
-	Treap<T> unit, other;
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+bool Treap<T, Compare, Canonical, Slot>::insert(const T& value) {
+	HealthProbe<Treap<T, Compare, Canonical, Slot>> probe(*this, TreeOp::insert);
+	// One descent settles a present value, and refreshes the digests on the way
+	if (multiset ? this->add_to_path(root, value, +1) > 0 : this->find(value) != nullptr)
+		return multiset;
+
+	Treap<T, Compare, Canonical, Slot> unit(multiset, cmp), other(multiset, cmp);
 	this->split(value, other);
-	unit.root = new TNode<T>(value);
+	unit.root = unit.leftmost = unit.rightmost = new TNode<T, Compare, Canonical, Slot>(value);
+
+	// An empty side means the new node is an end, join then picks it up
 
 	this->join(unit);
 
@@ -143,89 +461,545 @@ bool Treap<T>::insert(const T& value) {
 	return true;
 }
 
-template<typename T>
-void Treap<T>::erase(const T& value) {
-	Treap<T> singleton, other;
+// Removes every copy of value, like erase_all, and returns whether there was any
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+bool Treap<T, Compare, Canonical, Slot>::erase(const T& value) {
+	HealthProbe<Treap<T, Compare, Canonical, Slot>> probe(*this, TreeOp::erase);
+	Treap<T, Compare, Canonical, Slot> singleton(multiset, cmp), other(multiset, cmp);
 	this->split(value, singleton);
 	singleton.split(value, other, true);
 	this->join(other);
+	return !singleton.empty();
 }
 
-template<typename T>
-bool Treap<T>::contains(const T& value) {
-	TNode<T> *at = root;
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+bool Treap<T, Compare, Canonical, Slot>::erase_one(const T& value) {
+	HealthProbe<Treap<T, Compare, Canonical, Slot>> probe(*this, TreeOp::erase);
+	// Takes one copy off on the way down, the last one needs the split and join
+	unsigned found = this->add_to_path(root, value, -1);
+	if (found == 1)
+		this->erase(value);
+	return found > 0;
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+unsigned Treap<T, Compare, Canonical, Slot>::erase_all(const T& value) {
+	HealthProbe<Treap<T, Compare, Canonical, Slot>> probe(*this, TreeOp::erase);
+	unsigned removed = this->count(value);
+	if (removed > 0)
+		this->erase(value);
+	return removed;
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+template<typename K>
+typename Treap<T, Compare, Canonical, Slot>::Node* Treap<T, Compare, Canonical, Slot>::find(const K& key) {
+	TNode<T, Compare, Canonical, Slot> *at = root;
 
 	while (at != nullptr) {
-		if (value == at->value) return true;
-		if (value < at->value)
+		int c = __compare_helper_methods::compare(cmp, key, at->value);
+		if (c == 0) return at;
+		if (c < 0)
 			at = at->left;
 		else
 			at = at->right;
 	}
 
-  return false;
+	return nullptr;
 }
 
-template<typename T>
-std::pair<TNode<T>*, TNode<T>*> split_before(const T& value, TNode<T> *tree) {
+// Adds delta to the multiplicity of value under node, unless that would drop it
+// to zero, and returns the multiplicity before, 0 if absent. Only the sizes and
+// hashes on the search path change, refreshed on the way back up as pop does
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+unsigned Treap<T, Compare, Canonical, Slot>::add_to_path(typename Treap<T, Compare, Canonical, Slot>::Node* node, const T& value, int delta) {
+	if (node == nullptr) return 0;
+	int c = __compare_helper_methods::compare(cmp, value, node->value);
+	unsigned found;
+	if (c == 0) {
+		found = node->count;
+		if ((int) found + delta <= 0) return found;
+		node->count += delta;
+	} else {
+		found = add_to_path(c < 0 ? node->left : node->right, value, delta);
+		if (found == 0 || (int) found + delta <= 0) return found;
+	}
+	node->update_parameters();
+	return found;
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+unsigned Treap<T, Compare, Canonical, Slot>::count(const T& value) {
+	HealthProbe<Treap<T, Compare, Canonical, Slot>> probe(*this, TreeOp::lookup);
+	TNode<T, Compare, Canonical, Slot> *at = this->find(value);
+	return (at == nullptr ? 0 : at->count);
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+bool Treap<T, Compare, Canonical, Slot>::contains(const T& value) {
+	HealthProbe<Treap<T, Compare, Canonical, Slot>> probe(*this, TreeOp::lookup);
+	return this->find(value) != nullptr;
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+template<typename K, typename C, typename>
+unsigned Treap<T, Compare, Canonical, Slot>::count(const K& key) {
+	HealthProbe<Treap<T, Compare, Canonical, Slot>> probe(*this, TreeOp::lookup);
+	TNode<T, Compare, Canonical, Slot> *at = this->find(key);
+	return (at == nullptr ? 0 : at->count);
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+template<typename K, typename C, typename>
+bool Treap<T, Compare, Canonical, Slot>::contains(const K& key) {
+	HealthProbe<Treap<T, Compare, Canonical, Slot>> probe(*this, TreeOp::lookup);
+	return this->find(key) != nullptr;
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+const T& Treap<T, Compare, Canonical, Slot>::kth(unsigned k) {
+	if (k >= this->size())
+		throw std::out_of_range("Index out of range!");
+	TNode<T, Compare, Canonical, Slot> *at = root;
+
+	while (true) {
+		unsigned left_size = helper_methods::get_size(at->left);
+		if (k < left_size) {
+			at = at->left;
+		} else if (k < left_size + at->count) {
+			return at->value;
+		} else {
+			k -= left_size + at->count;
+			at = at->right;
+		}
+	}
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+unsigned Treap<T, Compare, Canonical, Slot>::rank(const T& value) {
+	unsigned smaller = 0;
+	TNode<T, Compare, Canonical, Slot> *at = root;
+
+	while (at != nullptr) {
+		if (cmp(at->value, value)) {
+			smaller += helper_methods::get_size(at->left) + at->count;
+			at = at->right;
+		} else {
+			at = at->left;
+		}
+	}
+
+	return smaller;
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+typename Treap<T, Compare, Canonical, Slot>::Node* Treap<T, Compare, Canonical, Slot>::min_node() {
+	if (leftmost == nullptr && root != nullptr) {
+		leftmost = root;
+		while (leftmost->left != nullptr)
+			leftmost = leftmost->left;
+	}
+	return leftmost;
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+typename Treap<T, Compare, Canonical, Slot>::Node* Treap<T, Compare, Canonical, Slot>::max_node() {
+	if (rightmost == nullptr && root != nullptr) {
+		rightmost = root;
+		while (rightmost->right != nullptr)
+			rightmost = rightmost->right;
+	}
+	return rightmost;
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+const T& Treap<T, Compare, Canonical, Slot>::min() {
+	if (this->empty())
+		throw std::out_of_range("Empty tree!");
+	return this->min_node()->value;
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+const T& Treap<T, Compare, Canonical, Slot>::max() {
+	if (this->empty())
+		throw std::out_of_range("Empty tree!");
+	return this->max_node()->value;
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+T Treap<T, Compare, Canonical, Slot>::pop_min() {
+	return this->pop(true);
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+T Treap<T, Compare, Canonical, Slot>::pop_max() {
+	return this->pop(false);
+}
+
+// Removes one copy of the smallest or largest value without comparing any
+// keys. The end has no inner child, so its outer subtree takes its place with
+// the heap order intact, and only the sizes and hashes on the spine change
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+T Treap<T, Compare, Canonical, Slot>::pop(bool smallest) {
+	if (this->empty())
+		throw std::out_of_range("Empty tree!");
+	TNode<T, Compare, Canonical, Slot> *end, *next;
+	root = pop(root, smallest, end, next);
+	(smallest ? leftmost : rightmost) = next;
+	if (root == nullptr)
+		leftmost = rightmost = nullptr;
+	if (end == next)
+		return end->value;
+	T value = std::move(end->value);
+	delete end;
+	return value;
+}
+
+// Takes one copy off the end under node and returns what replaces node. end is
+// the node that held it and next the end after, null if the subtree emptied:
+// the innermost node of the outer subtree, or else the parent
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+typename Treap<T, Compare, Canonical, Slot>::Node* Treap<T, Compare, Canonical, Slot>::pop(typename Treap<T, Compare, Canonical, Slot>::Node* node, bool smallest,
+                                                                                         typename Treap<T, Compare, Canonical, Slot>::Node*& end,
+                                                                                         typename Treap<T, Compare, Canonical, Slot>::Node*& next) {
+	TNode<T, Compare, Canonical, Slot> *&inner = (smallest ? node->left : node->right);
+	if (inner != nullptr) {
+		inner = pop(inner, smallest, end, next);
+		if (next == nullptr)
+			next = node;
+		node->update_parameters();
+		return node;
+	}
+
+	end = node;
+	if (node->count > 1) {
+		node->count--;
+		node->update_parameters();
+		next = node;
+		return node;
+	}
+	TNode<T, Compare, Canonical, Slot> *outer = (smallest ? node->right : node->left);
+	next = outer;
+	while (next != nullptr && (smallest ? next->left : next->right) != nullptr)
+		next = (smallest ? next->left : next->right);
+	return outer;
+}
+
+template<typename Node, typename K, typename Compare>
+std::pair<Node*, Node*> helper_methods::split_before(const K& value, Node *tree, const Compare& cmp) {
 	if (tree == nullptr) return std::make_pair(nullptr, nullptr);
-	TNode<T> *left, *right;
-	if (tree->value < value) {
-		std::tie(left, right) = split_before(value, tree->right);
+	Node *left, *right;
+	if (cmp(tree->value, value)) {
+		std::tie(left, right) = split_before(value, tree->right, cmp);
 		tree->set_right(left);
 		return std::make_pair(tree, right);
 	} else {
-		std::tie(left, right) = split_before(value, tree->left);
+		std::tie(left, right) = split_before(value, tree->left, cmp);
 		tree->set_left(right);
 		return std::make_pair(left, tree);
 	}
 }
 
-template<typename T>
-std::pair<TNode<T>*, TNode<T>*> split_after(const T& value, TNode<T> *tree) {
+template<typename Node, typename K, typename Compare>
+std::pair<Node*, Node*> helper_methods::split_after(const K& value, Node *tree, const Compare& cmp) {
 	if (tree == nullptr) return std::make_pair(nullptr, nullptr);
-	TNode<T> *left, *right;
-	if (tree->value <= value) {
-		std::tie(left, right) = split_after(value, tree->right);
+	Node *left, *right;
+	if (!cmp(value, tree->value)) {
+		std::tie(left, right) = split_after(value, tree->right, cmp);
 		tree->set_right(left);
 		return std::make_pair(tree, right);
 	} else {
-		std::tie(left, right) = split_after(value, tree->left);
+		std::tie(left, right) = split_after(value, tree->left, cmp);
 		tree->set_left(right);
 		return std::make_pair(left, tree);
 	}
 }
 
-template<typename T>
-void Treap<T>::split(const T& value, Treap<T>& other, bool after) {
-	TNode<T> *left, *right;
+// Moves the values from value on, or after it if after is set, into other,
+// which loses what it held first
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+void Treap<T, Compare, Canonical, Slot>::split(const T& value, Treap<T, Compare, Canonical, Slot>& other, bool after) {
+	other.clear();
+	TNode<T, Compare, Canonical, Slot> *left, *right;
 	if (after)
-		std::tie(left, right) = split_after(value, this->root);
+		std::tie(left, right) = helper_methods::split_after(value, this->root, cmp);
 	else
-		std::tie(left, right) = split_before(value, this->root);
+		std::tie(left, right) = helper_methods::split_before(value, this->root, cmp);
 	this->root = left;
 	other.root = right;
+	other.leftmost = nullptr;
+	other.rightmost = (right != nullptr ? this->rightmost : nullptr);
+	if (left == nullptr)
+		this->leftmost = nullptr;
+	this->rightmost = nullptr;
 }
 
-template<typename T>
-TNode<T>* helper_methods::join_aux(TNode<T>* left, TNode<T>* right) {
+// Detaches the values in [lo, hi] into a new tree with two splits and a join
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+Treap<T, Compare, Canonical, Slot> Treap<T, Compare, Canonical, Slot>::extract_range(const T& lo, const T& hi) {
+	Treap<T, Compare, Canonical, Slot> middle(multiset, cmp), right(multiset, cmp);
+	this->split(lo, middle);
+	middle.split(hi, right, true);
+	this->join(right);
+	TNode<T, Compare, Canonical, Slot> *range = middle.root;
+	middle.root = nullptr;
+	return Treap<T, Compare, Canonical, Slot>(range, multiset, cmp);
+}
+
+// Detaches the values in [lo, hi] like extract_range and returns how many
+// there were. The nodes are only deleted by reclaim or the destructor
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+unsigned Treap<T, Compare, Canonical, Slot>::erase_range(const T& lo, const T& hi) {
+	Treap<T, Compare, Canonical, Slot> range = this->extract_range(lo, hi);
+	unsigned removed = range.size();
+	graveyard.push(range.root);
+	range.root = nullptr;
+	return removed;
+}
+
+// Deletes up to budget nodes detached by erase_range, returns how many were deleted
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+size_t Treap<T, Compare, Canonical, Slot>::reclaim(size_t budget) {
+	return graveyard.reclaim(budget);
+}
+
+template<typename Node>
+Node* helper_methods::join_aux(Node* left, Node* right) {
 	if (left == nullptr) return right;
 	if (right == nullptr) return left;
 	if (left->priority > right->priority) {
-		TNode<T>* result = join_aux<T>(left->right, right);
+		Node* result = join_aux(left->right, right);
 		left->set_right(result);
 		return left;
 	} else {
-		TNode<T>* result = join_aux<T>(left, right->left);
+		Node* result = join_aux(left, right->left);
 		right->set_left(result);
 		return right;
 	}
 }
 
-template<typename T>
-void Treap<T>::join(Treap<T>& other) {
-	this->root = helper_methods::join_aux<T>(this->root, other.root);
-	other.root = nullptr;
+// Whether a goes above b. Ties go to the larger value, as in join_aux, so a
+// canonical treap has the same shape however it was built
+template<typename Node, typename Compare>
+bool helper_methods::has_priority(Node* a, Node* b, const Compare& cmp) {
+	return a->priority > b->priority || (a->priority == b->priority && cmp(b->value, a->value));
+}
+
+template<typename Node, typename Compare>
+void helper_methods::heapify(Node* node, const Compare& cmp) {
+	while (node != nullptr) {
+		Node* top = node;
+		if (node->left != nullptr && has_priority(node->left, top, cmp))
+			top = node->left;
+		if (node->right != nullptr && has_priority(node->right, top, cmp))
+			top = node->right;
+		if (top == node) return;
+		std::swap(node->priority, top->priority);
+		node = top;
+	}
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+void Treap<T, Compare, Canonical, Slot>::join(Treap<T, Compare, Canonical, Slot>& other) {
+	if (other.root != nullptr) {
+		if (this->root == nullptr)
+			this->leftmost = other.leftmost;
+		this->rightmost = other.rightmost;
+	}
+	this->root = helper_methods::join_aux(this->root, other.root);
+	other.root = other.leftmost = other.rightmost = nullptr;
+}
+
+// Calls f once for every element, from several threads and in no particular order.
+// Subtrees are handed to new threads in proportion to their size
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+template<typename F>
+void Treap<T, Compare, Canonical, Slot>::parallel_for_each(F f, unsigned threads) {
+	__parallel_helper_methods::for_each_value(this->root, f, std::max(1u, threads));
+}
+
+// Folds map(value) of every element in order with combine, which must be associative
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+template<typename R, typename Map, typename Combine>
+R Treap<T, Compare, Canonical, Slot>::parallel_reduce(R identity, Map map, Combine combine, unsigned threads) {
+	return __parallel_helper_methods::reduce_values(this->root, identity, map, combine, std::max(1u, threads));
+}
+
+// Returns a new treap with the values satisfying pred. A kept node keeps its
+// priority, so it can sit above its filtered subtrees, and the subtrees of a
+// dropped node are put back together with join
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+template<typename Pred>
+Treap<T, Compare, Canonical, Slot> Treap<T, Compare, Canonical, Slot>::parallel_filter(Pred pred, unsigned threads) {
+	return Treap<T, Compare, Canonical, Slot>(parallel_filter(this->root, pred, std::max(1u, threads)), multiset, cmp);
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+template<typename Pred>
+typename Treap<T, Compare, Canonical, Slot>::Node* Treap<T, Compare, Canonical, Slot>::parallel_filter(typename Treap<T, Compare, Canonical, Slot>::Node* node, Pred& pred, unsigned threads) {
+	if (node == nullptr) return nullptr;
+	if (node->size < __parallel_helper_methods::grain) threads = 1;
+	unsigned left_threads = __parallel_helper_methods::share(threads, helper_methods::get_size(node->left), node->size);
+	TNode<T, Compare, Canonical, Slot> *left, *right;
+	__parallel_helper_methods::fork(threads,
+		[&] { left = parallel_filter(node->left, pred, left_threads); },
+		[&] { right = parallel_filter(node->right, pred, __parallel_helper_methods::rest(threads, left_threads)); });
+	if (!pred(node->value))
+		return helper_methods::join_aux(left, right);
+	TNode<T, Compare, Canonical, Slot> *kept = new TNode<T, Compare, Canonical, Slot>(node->value, node->count, node->priority);
+	kept->left = left;
+	kept->right = right;
+	kept->update_parameters();
+	return kept;
+}
+
+// Whether the treap is in key order and in heap order of the priorities, with
+// exact sizes and heights, and the cached ends, where known, are its first and last nodes
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+bool Treap<T, Compare, Canonical, Slot>::verify() {
+	TNode<T, Compare, Canonical, Slot> *first = root, *last = root;
+	while (first != nullptr && first->left != nullptr)
+		first = first->left;
+	while (last != nullptr && last->right != nullptr)
+		last = last->right;
+	if ((leftmost != nullptr && leftmost != first) || (rightmost != nullptr && rightmost != last))
+		return false;
+	return this->verify(this->root, nullptr, nullptr) >= 0;
+}
+
+// The height of node's subtree, or -1 if it breaks an invariant
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+int Treap<T, Compare, Canonical, Slot>::verify(typename Treap<T, Compare, Canonical, Slot>::Node* node, const T* lo, const T* hi) {
+	if (node == nullptr)
+		return 0;
+	if (node->count == 0 || (!multiset && node->count > 1))
+		return -1;
+	if ((lo != nullptr && !cmp(*lo, node->value)) || (hi != nullptr && !cmp(node->value, *hi)))
+		return -1;
+	for (TNode<T, Compare, Canonical, Slot>* child : {node->left, node->right})
+		if (child != nullptr && helper_methods::has_priority(child, node, cmp))
+			return -1;
+	int hl = this->verify(node->left, lo, &node->value);
+	int hr = this->verify(node->right, &node->value, hi);
+	if (hl < 0 || hr < 0 || node->height != 1 + (unsigned) std::max(hl, hr))
+		return -1;
+	if (node->size != helper_methods::get_size(node->left) + node->count + helper_methods::get_size(node->right))
+		return -1;
+	return node->height;
+}
+
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+uint64_t Treap<T, Compare, Canonical, Slot>::hash() {
+	static_assert(Canonical, "Only canonical treaps keep hashes!");
+	return helper_methods::get_hash(this->root);
+}
+
+// O(1) for canonical treaps, otherwise the contents are compared in order
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+bool Treap<T, Compare, Canonical, Slot>::equals(Treap<T, Compare, Canonical, Slot>& other) {
+	if (this->size() != other.size()) return false;
+	if constexpr (Canonical) {
+		return this->hash() == other.hash();
+	} else {
+		std::vector<T> mine, theirs;
+		diff(*this, other, mine, theirs);
+		return mine.empty() && theirs.empty();
+	}
+}
+
+// Appends to out the values of the subtree within the open range (lo, hi),
+// a null bound is unbounded
+template<typename Node, typename T, typename Compare>
+void helper_methods::collect(Node* node, const T* lo, const T* hi, std::vector<T>& out, const Compare& cmp) {
+	if (node == nullptr) return;
+	bool above_lo = (lo == nullptr || cmp(*lo, node->value));
+	bool below_hi = (hi == nullptr || cmp(node->value, *hi));
+	if (above_lo)
+		collect(node->left, lo, hi, out, cmp);
+	if (above_lo && below_hi)
+		out.insert(out.end(), node->count, node->value);
+	if (below_hi)
+		collect(node->right, lo, hi, out, cmp);
+}
+
+// Fills only_a and only_b with the values (one entry per copy) that are in
+// one treap and not in the other. For canonical treaps subtrees with equal
+// hashes are skipped, which takes O(d log n) for d differences
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+void Treap<T, Compare, Canonical, Slot>::diff(Treap<T, Compare, Canonical, Slot>& a, Treap<T, Compare, Canonical, Slot>& b, std::vector<T>& only_a, std::vector<T>& only_b) {
+	if constexpr (Canonical) {
+		a.diff(a.root, nullptr, nullptr, b.root, nullptr, nullptr, nullptr, nullptr, only_a, only_b);
+		return;
+	}
+	std::vector<T> va, vb;
+	helper_methods::collect(a.root, (const T*) nullptr, (const T*) nullptr, va, a.cmp);
+	helper_methods::collect(b.root, (const T*) nullptr, (const T*) nullptr, vb, a.cmp);
+	size_t i = 0, j = 0;
+	while (i < va.size() || j < vb.size()) {
+		if (j == vb.size() || (i < va.size() && a.cmp(va[i], vb[j])))
+			only_a.push_back(va[i++]);
+		else if (i == va.size() || a.cmp(vb[j], va[i]))
+			only_b.push_back(vb[j++]);
+		else
+			i++, j++;
+	}
+}
+
+// Compares the parts of x and y within the open range (lo, hi). x_lo and x_hi
+// are the bounds x's subtree has in its own treap, y_lo and y_hi the same for y.
+// In a canonical treap the root of any range is its highest priority value,
+// so two differing roots mean the higher one is missing from the other side
+template<typename T, typename Compare, bool Canonical, size_t Slot>
+void Treap<T, Compare, Canonical, Slot>::diff(typename Treap<T, Compare, Canonical, Slot>::Node* x, const T* x_lo, const T* x_hi, typename Treap<T, Compare, Canonical, Slot>::Node* y, const T* y_lo, const T* y_hi,
+                    const T* lo, const T* hi, std::vector<T>& only_x, std::vector<T>& only_y) {
+	auto narrow = [&](TNode<T, Compare, Canonical, Slot>*& node, const T*& node_lo, const T*& node_hi) {
+		while (node != nullptr) {
+			if (lo != nullptr && !cmp(*lo, node->value)) {
+				node_lo = &node->value;
+				node = node->right;
+			} else if (hi != nullptr && !cmp(node->value, *hi)) {
+				node_hi = &node->value;
+				node = node->left;
+			} else {
+				break;
+			}
+		}
+	};
+	// Whether the whole subtree lies within (lo, hi), so its hash describes the range
+	auto whole = [&](const T* node_lo, const T* node_hi) {
+		return (lo == nullptr || (node_lo != nullptr && !cmp(*node_lo, *lo)))
+		    && (hi == nullptr || (node_hi != nullptr && !cmp(*hi, *node_hi)));
+	};
+
+	narrow(x, x_lo, x_hi);
+	narrow(y, y_lo, y_hi);
+	if (x == nullptr) {
+		helper_methods::collect(y, lo, hi, only_y, cmp);
+		return;
+	}
+	if (y == nullptr) {
+		helper_methods::collect(x, lo, hi, only_x, cmp);
+		return;
+	}
+	if (x->hash == y->hash && whole(x_lo, x_hi) && whole(y_lo, y_hi))
+		return;
+
+	if (__compare_helper_methods::compare(cmp, x->value, y->value) == 0) {
+		if (x->count > y->count)
+			only_x.insert(only_x.end(), x->count - y->count, x->value);
+		if (y->count > x->count)
+			only_y.insert(only_y.end(), y->count - x->count, y->value);
+		diff(x->left, x_lo, &x->value, y->left, y_lo, &y->value, lo, &x->value, only_x, only_y);
+		diff(x->right, &x->value, x_hi, y->right, &y->value, y_hi, &x->value, hi, only_x, only_y);
+	} else if (helper_methods::has_priority(x, y, cmp)) {
+		only_x.insert(only_x.end(), x->count, x->value);
+		diff(x->left, x_lo, &x->value, y, y_lo, y_hi, lo, &x->value, only_x, only_y);
+		diff(x->right, &x->value, x_hi, y, y_lo, y_hi, &x->value, hi, only_x, only_y);
+	} else {
+		only_y.insert(only_y.end(), y->count, y->value);
+		diff(x, x_lo, x_hi, y->left, y_lo, &y->value, lo, &y->value, only_x, only_y);
+		diff(x, x_lo, x_hi, y->right, &y->value, y_hi, &y->value, hi, only_x, only_y);
+	}
 }
 
 #endif